@@ -0,0 +1,153 @@
+// Benchmarks of the point lookups and range queries.
+//
+// Usage: QuadtreeBenchmarks [find|deep|arena]...  (all of them by default)
+//
+// 1. find: random lookups on uniform trees of increasing depth, FindByDepthSearch vs FindByDescent.
+// 2. deep: lookups of existing points on clustered trees in a 2^28 grid, where the trees get deep.
+// 3. arena: lookups and range queries on a 4M nodes tree, default allocator vs huge pages.
+//
+// Times are the best of a few rounds. To compare with an older version of the library, build this
+// file against its Quadtree.hpp, e.g. `git show <commit>:Source/Quadtree.hpp > old/Quadtree.hpp`.
+
+#include "Quadtree.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <utility>
+#include <vector>
+
+using Points = std::vector<std::pair<int, int>>;
+
+// Returns the best average time in nanoseconds of given function called for each item.
+template <typename Items, typename F>
+double Measure(const Items& items, F&& f, int rounds = 3)
+{
+	double best = 1e18;
+	for (int i = 0; i < rounds; i++)
+	{
+		auto t0 = std::chrono::steady_clock::now();
+		for (const auto& item : items)
+			f(item);
+		auto t1 = std::chrono::steady_clock::now();
+		best = std::min(best, std::chrono::duration<double, std::nano>(t1 - t0).count() / items.size());
+	}
+	return best;
+}
+
+// Sink of the results, so the lookups aren't optimized out.
+static long sink = 0;
+
+void BenchFind()
+{
+	puts("find: uniform points, ssf n <= 4, 2M random lookups");
+	int cfg[][2] = { { 64, 200 }, { 1024, 2000 }, { 4096, 20000 }, { 65536, 100000 }, { 1 << 20, 200000 },
+		{ 1 << 24, 300000 } };
+	for (auto [w, n] : cfg)
+	{
+		Quadtree::Quadtree<int> tree(w, w, [](int w, int h, int n) { return n <= 4; });
+		tree.Build();
+		std::mt19937 rng(1);
+		for (int i = 0; i < n; i++)
+			tree.Add(rng() % w, rng() % w, i);
+		Points q;
+		for (int i = 0; i < 2000000; i++)
+			q.push_back({ int(rng() % w), int(rng() % w) });
+		auto a = Measure(q, [&](auto p) { sink += (long)tree.FindByDepthSearch(p.first, p.second); });
+		auto b = Measure(q, [&](auto p) { sink += (long)tree.FindByDescent(p.first, p.second); });
+		printf("  depth %2d, %7d nodes: depth search %6.1f ns, descent %6.1f ns\n", tree.Depth(),
+			tree.NumNodes(), a, b);
+	}
+}
+
+void BenchDeep()
+{
+	puts("deep: 2000 clusters of 50 points in a 2^28 grid, ssf n <= 4, 2M lookups of existing points");
+	const int W = 1 << 28;
+	for (int scale : { 6, 8, 10, 12, 14, 16 })
+	{
+		Quadtree::Quadtree<int> tree(W, W, [](int w, int h, int n) { return n <= 4; });
+		tree.Build();
+		std::mt19937 rng(1);
+		Points		 points;
+		for (int c = 0; c < 2000; c++)
+		{
+			int cx = rng() % (W - (1 << scale)), cy = rng() % (W - (1 << scale));
+			for (int i = 0; i < 50; i++)
+			{
+				int x = cx + rng() % (1 << (28 - scale)), y = cy + rng() % (1 << (28 - scale));
+				points.push_back({ x, y });
+				tree.Add(x, y, c * 50 + i);
+			}
+		}
+		Points q;
+		for (int i = 0; i < 2000000; i++)
+			q.push_back(points[rng() % points.size()]);
+		auto a = Measure(q, [&](auto p) { sink += (long)tree.FindByDepthSearch(p.first, p.second); });
+		auto b = Measure(q, [&](auto p) { sink += (long)tree.FindByDescent(p.first, p.second); });
+		Points boxes(q.begin(), q.begin() + 20000);
+		auto   c = Measure(boxes, [&](auto p) {
+			  auto [x, y] = p;
+			  tree.QueryRange(x - (1 << 20), y - (1 << 20), x + (1 << 20), y + (1 << 20),
+				  [&](int, int, int o) { sink += o; });
+		  });
+		printf("  depth %2d, %7d nodes: depth search %6.1f ns, descent %6.1f ns, 2^21 box query %.2f us\n",
+			tree.Depth(), tree.NumNodes(), a, b, c / 1000);
+	}
+}
+
+void BenchArena()
+{
+	puts("arena: 1.5M random points in a 2^24 grid, ssf n <= 1, 3M lookups of existing points");
+	const int W = 1 << 24;
+	for (auto policy : { Quadtree::AllocatorPolicy::Default, Quadtree::AllocatorPolicy::HugePages })
+	{
+		Quadtree::Quadtree<int> tree(W, W, [](int w, int h, int n) { return n <= 1; });
+		tree.SetAllocatorPolicy(policy);
+		tree.Build();
+		std::mt19937 rng(1);
+		Points		 points;
+		for (int i = 0; i < 1500000; i++)
+		{
+			int x = rng() % W, y = rng() % W;
+			points.push_back({ x, y });
+			tree.Add(x, y, i);
+		}
+		Points q;
+		for (int i = 0; i < 3000000; i++)
+			q.push_back(points[rng() % points.size()]);
+		auto a = Measure(q, [&](auto p) { sink += (long)tree.FindByDepthSearch(p.first, p.second); });
+		auto b = Measure(q, [&](auto p) { sink += (long)tree.FindByDescent(p.first, p.second); });
+		Points boxes(q.begin(), q.begin() + 20000);
+		auto   c = Measure(boxes, [&](auto p) {
+			  auto [x, y] = p;
+			  tree.QueryRange(x - 20000, y - 20000, x + 20000, y + 20000, [&](int, int, int o) { sink += o; });
+		  });
+		printf("  %-10s depth %2d, %7d nodes: depth search %6.1f ns, descent %6.1f ns, 40k box query %.2f us\n",
+			policy == Quadtree::AllocatorPolicy::Default ? "default:" : "huge pages:", tree.Depth(),
+			tree.NumNodes(), a, b, c / 1000);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	auto enabled = [&](const char* name) {
+		if (argc == 1)
+			return true;
+		for (int i = 1; i < argc; i++)
+			if (!strcmp(argv[i], name))
+				return true;
+		return false;
+	};
+	if (enabled("find"))
+		BenchFind();
+	if (enabled("deep"))
+		BenchDeep();
+	if (enabled("arena"))
+		BenchArena();
+	if (sink == 42)
+		puts("");
+	return 0;
+}
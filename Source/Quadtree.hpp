@@ -1,7 +1,7 @@
 // Optimized quadtrees on grid rectangles in C++.
 // https://github.com/hit9/quadtree-hpp
 //
-// BSD license. Chao Wang, Version: 0.4.0
+// BSD license. Chao Wang, Version: 0.4.26
 //
 // Coordinate conventions:
 //
@@ -16,6 +16,31 @@
 
 // changes
 // ~~~~~~~
+// 0.4.26: Add background rebuild, `StartRebuild`, `IsRebuildReady` and `FinishRebuild`.
+// 0.4.25: Add auto-tuning of the split threshold, `SetAutoTune`, `Tune` and `GetTuneStats`.
+// 0.4.24: Add query-driven adaptive refinement, `SetAdaptive` and `Adapt`.
+// 0.4.23: Add occupancy bitmaps for small leaf nodes, `IsCellOccupied`, `IsRectEmpty` and `FirstOccupiedCellInRow`.
+// 0.4.22: `ObjectKeyHasher` is noexcept, objects elements no longer cache hash codes.
+// 0.4.21: Add `SetMemoryResource`, `Objects` and `RectObjects` become `std::pmr` containers.
+// 0.4.20: Add `AllocatorPolicy` and `HugePageArena` to allocate nodes from huge pages.
+// 0.4.19: Add prefetching to traversals, and speculative probes with `PackScaled` ids in the depth search of `Find`.
+// 0.4.18: Add `FindByDescent` via the middle points stored in nodes, `Find` chooses it on shallow trees.
+// 0.4.17: Add `BakedQuadtree`, a read-only snapshot in the van Emde Boas layout.
+// 0.4.16: Add compressed edges `Node::skip`, used by `QueryRange`, `Find` and `FindSmallestNodeCoveringRange`.
+// 0.4.15: Add the sparse mode `SetSparse`, empty leaf nodes are not materialised.
+// 0.4.14: Add the budgeted mode for restructuring, `SetBudget` and `Step`.
+// 0.4.13: Replace the node table with `NodeTable`, an intrusive hash table growing incrementally.
+// 0.4.12: Add `Reserve` and the recycling mode to reuse removed nodes and their containers.
+// 0.4.11: Add move semantics and `Clone`, disable copying.
+// 0.4.10: Add `FloatQuadtree`, an adapter on real-valued coordinates with exact range and radius filters.
+// 0.4.9: Add `PackN`, the node id packing generalized on dimension.
+// 0.4.8: Add rectangle objects, `AddRect`, `RemoveRect` and `QueryRectsInRange`.
+// 0.4.7: Add `RemoveIf` and `RemoveIfInRange`.
+// 0.4.6: Add `RemoveRange`.
+// 0.4.5: Add `RegionQuadtree` to manage per-cell values in uniform-valued blocks.
+// 0.4.4: Add clustering informations (centroid and bounding box of objects) to nodes, and `QueryRangeLOD`.
+// 0.4.3: Add `ExportDensity`.
+// 0.4.2: Add subtree objects counter `Node::n` and `SampleRange`.
 // 0.4.1: Limit query range AABB box to winth th grid for QueryRange and QueryLeafNodesInRange.
 // 0.4.0: **Breaking change**: switch to ue coding style.
 // 0.3.0: **Breaking change**: inverts the coordinates conventions.
@@ -25,13 +50,30 @@
 #define HIT9_QUADTREE_HPP
 
 #include <algorithm>	 // for std::max
-#include <cstdint>		 // for std::uint64_t
+#include <chrono>		 // for std::chrono::seconds
+#include <cstddef>		 // for std::max_align_t
+#include <cstdint>		 // for std::uint64_t, std::int64_t
+#include <cstdlib>		 // for std::calloc, std::free
+#include <climits>		 // for INT_MAX
 #include <cstring>		 // for memset
+#include <deque>		 // for std::deque
 #include <functional>	 // for std::function, std::hash
+#include <future>		 // for std::async, std::future
+#include <iterator>		 // for std::advance
+#include <memory>		 // for std::unique_ptr
+#include <memory_resource> // for std::pmr::memory_resource
+#include <new>			 // for placement new
+#include <random>		 // for std::uniform_int_distribution
+#include <type_traits>	 // for std::conditional_t
 #include <unordered_map> // for std::unordered_map
 #include <unordered_set> // for std::unordered_set
+#include <utility>		 // for std::declval
 #include <vector>
 
+#if defined(__linux__)
+	#include <sys/mman.h> // for mmap, madvise
+#endif
+
 namespace Quadtree
 {
 
@@ -40,6 +82,7 @@ namespace Quadtree
 	// The maximum depth of a quadtree.
 	const int MAX_DEPTH = 29;
 
+	using std::int64_t;
 	using std::uint64_t;
 	using std::uint8_t;
 
@@ -56,18 +99,73 @@ namespace Quadtree
 	// 4. For nodes at the same depth, the id changes with the size of x*h+y.
 	using NodeId = uint64_t;
 
+	// PackN caculates the id of a node in a Dim dimensional region, it's the generalization of Pack.
+	// The highest 6 bits are the depth d, the following bits are divided equally by the axes, that is
+	// 29 bits for each axis if Dim is 2 and 19 bits if Dim is 3:
+	//
+	// +----- 6bit -----+-- (58/Dim) bits --+-- (58/Dim) bits --+ ...
+	// | depth d (6bit) | floor(p0*(2^d)/s0) | floor(p1*(2^d)/s1) | ...
+	// +----------------+-------------------+-------------------+
+	//
+	// The p is any position inside the node, and s is the size of the whole region on each axis.
+	template <int Dim>
+	inline NodeId PackN(uint64_t d, const uint64_t (&p)[Dim], const uint64_t (&s)[Dim])
+	{
+		constexpr int	   BITS = 58 / Dim;
+		constexpr uint64_t MASK = (1ULL << BITS) - 1;
+		// 0xfc00000000000000 : the highest 6 bits are all 1, the other bits are all 0.
+		NodeId id = (d << 58) & 0xfc00000000000000ULL;
+		for (int i = 0; i < Dim; i++)
+			id |= (((1ULL << d) * p[i] / s[i]) & MASK) << (BITS * (Dim - 1 - i));
+		return id;
+	}
+
 	// pack caculates the id of a node.
 	// the d is the depth of the node, the (x,y) is any position inside the node's rectangle.
 	// the w and h is the whole rectangular region managed by the quadtree.
 	inline NodeId Pack(uint64_t d, uint64_t x, uint64_t y, uint64_t w, uint64_t h)
 	{
-		// The following magic numbers:
-		// 0xfc00000000000000 : the highest 6 bits are all 1, the other bits are all 0.
-		// 0x3ffffffe0000000  : the highest 6 bits are all 0, the following 29 bits are all 1,
-		// and the
-		//                      other bits are all 0.
-		// 0x1fffffff         : the lowest 29 bits are all 1, the other bits are all 0.
-		return ((d << 58) & 0xfc00000000000000ULL) | ((((1 << d) * x / w) << 29) & 0x3ffffffe0000000ULL) | (((1 << d) * y / h) & 0x1fffffffULL);
+		return PackN<2>(d, { x, y }, { w, h });
+	}
+
+	// PackScaled calculates the same id to Pack(d,x,y,w,h) without divisions, from the scaled
+	// position (qx,qy) = (floor(x*(2^D)/w), floor(y*(2^D)/h)) at a depth D >= d, since
+	// floor(floor(a)/2^k) == floor(a/2^k). It's for probing many depths of the same position.
+	inline NodeId PackScaled(uint64_t d, uint64_t qx, uint64_t qy, int D)
+	{
+		constexpr uint64_t MASK = (1ULL << 29) - 1;
+		NodeId			   id = (d << 58) & 0xfc00000000000000ULL;
+		return id | (((qx >> (D - d)) & MASK) << 29) | ((qy >> (D - d)) & MASK);
+	}
+
+	// SplitMiddle calculates the middle position m to split the range [lo, hi] of a node at depth d
+	// along an axis, where size is the length of the whole region on this axis.
+	// The two halves are [lo, m] and [m+1, hi], the second half is empty if lo == hi.
+	inline int SplitMiddle(uint64_t d, int lo, int hi, int size)
+	{
+		int m = lo + (hi - lo) / 2;
+		// determines which side m belongs:
+		// by default, we assume m belongs to the left side.
+		// but if the ids of lo and m are going to dismatch, which means the m should belong to the
+		// right side, that is we should minus m by 1.
+		// And minus by 1 should be enough, because m-2 always equals to m-4, m-8,.. until lo.
+		// Potential optimization: how to avoid the division here?
+		uint64_t k = 1ULL << (d + 1);
+		if ((k * m / size) != (k * lo / size))
+			--m;
+		return m;
+	}
+
+	// Prefetch hints the cpu to load the cache line containing given address ahead of its use, so
+	// that the cache misses of independent loads overlap. It's a no-op on compilers without the
+	// builtin.
+	inline void Prefetch(const void* p)
+	{
+#if defined(__GNUC__) || defined(__clang__)
+		__builtin_prefetch(p);
+#else
+		(void)p;
+#endif
 	}
 
 	template <typename Object>
@@ -80,17 +178,30 @@ namespace Quadtree
 	};
 
 	// Hasher for ObjectKey.
+	// It's noexcept if the ObjectHasher is, so that the hash codes are not cached inside the set's
+	// elements (by libstdc++), the hash is cheap to recompute.
 	template <typename Object, typename ObjectHasher = std::hash<Object>>
 	struct ObjectKeyHasher
 	{
-		std::size_t operator()(const ObjectKey<Object>& k) const;
+		std::size_t operator()(const ObjectKey<Object>& k) const
+			noexcept(noexcept(ObjectHasher{}(std::declval<const Object&>())));
+	};
+
+	// RectObjectKey is an object with extents, occupying the rectangle [(x1,y1), (x2,y2)].
+	template <typename Object>
+	struct RectObjectKey
+	{
+		int	   x1, y1, x2, y2;
+		Object o;
+		// RectObjectKey is comparable.
+		bool operator==(const RectObjectKey& other) const;
 	};
 
 	// SplitingStopper is the type of the function to check if a node should stop to split.
 	// The parameters here:
 	//  w (int): the node's rectangle's width.
 	//  h (int): the node's rectangle's height.
-	//  n (int): the number of objects managed by the node.
+	//  n (int): the number of objects managed by the node, including the rectangle objects.
 	// What's more, if the w and h are both 1, it stops to split anyway.
 	// Examples:
 	//  1. to split into small rectangles not too small (e.g. at least 10x10)
@@ -106,9 +217,15 @@ namespace Quadtree
 	using SplitingStopperV2 = std::function<bool(int x1, int y1, int x2, int y2, int n)>;
 
 	// Objects is the container to store objects and their positions.
-	// It's an unordered_set of {x, y, object} structs.
+	// It's an unordered_set of {x, y, object} structs, allocating from a memory resource, which is the
+	// tree's one for the containers inside nodes (see Quadtree::SetMemoryResource).
 	template <typename Object, typename ObjectHasher = std::hash<Object>>
-	using Objects = std::unordered_set<ObjectKey<Object>, ObjectKeyHasher<Object, ObjectHasher>>;
+	using Objects = std::pmr::unordered_set<ObjectKey<Object>, ObjectKeyHasher<Object, ObjectHasher>>;
+
+	// RectObjects is the container to store rectangle objects.
+	// It's a vector, since most nodes store none or a few of them.
+	template <typename Object>
+	using RectObjects = std::pmr::vector<RectObjectKey<Object>>;
 
 	// The structure of a tree node.
 	template <typename Object, typename ObjectHasher = std::hash<Object>>
@@ -123,16 +240,47 @@ namespace Quadtree
 		//             |               |
 		//             +---------------+ (x2,y2)
 		int x1, y1, x2, y2;
+		// (x3,y3) is the middle point spliting the children of a non-leaf node, the child containing
+		// position (x,y) is at index (x > x3) + 2 * (y > y3). Meaningless for a leaf node.
+		int x3, y3;
 		// Children: 0: left-top, 1: right-top, 2: left-bottom, 3: right-bottom
 		// For a leaf node, the children of which are all nullptr.
-		// For a non-leaf node, there's atleast one non-nullptr child.
+		// For a non-leaf node, there's atleast one non-nullptr child, except in sparse mode, where
+		// the absent children are implicit empty leaf nodes.
 		//
 		//       +-----+-----+
 		//       |  0  |  1  |
 		//       +-----+-----+
 		//       |  2  |  3  |
 		//       +-----+-----+
+		// The children are allocated and freed by the tree (see Quadtree::FreeNodes), not by this node.
 		Node* children[4];
+		// The parent node, nullptr for the root.
+		Node* parent = nullptr;
+		// n is the number of objects inside this node's rectangle.
+		// For a leaf node, it's equal to objects.size().
+		// For a non-leaf node, it's the sum of its children's n.
+		int n = 0;
+		// Clustering informations of the objects inside this node's rectangle, maintained for both leaf
+		// and non-leaf nodes:
+		// 1. (sx, sy) is the sum of the objects' positions, the centroid is (sx/n, sy/n).
+		// 2. (bx1,by1) and (bx2,by2) are the upper-left and lower-right corners of the bounding box of
+		//    the objects, only valid if n > 0.
+		int64_t sx = 0, sy = 0;
+		int		bx1 = 0, by1 = 0, bx2 = -1, by2 = -1;
+		// The rectangle objects whose smallest enclosing node is this node, for both leaf and non-leaf
+		// nodes. A rectangle object is stored only once, in the smallest node containing it.
+		RectObjects<Object> rects;
+		// nr is the number of rectangle objects stored in this node and all its descendants.
+		// The number of objects passed to the ssf function for this node is n + nr.
+		int nr = 0;
+		// The occupancy bitmap of a leaf node with at most 8x8 cells, maintained only if the tree's
+		// occupancy bitmaps are turned on (see Quadtree::SetOccupancyBitmaps): the bit at
+		// (y-y1)*8 + (x-x1) is set if there's any object at cell (x,y). Meaningless for other nodes.
+		uint64_t occupancy = 0;
+		// The decayed count of the scans by QueryRange on this node mostly outside the query ranges,
+		// maintained only in adaptive mode (see Quadtree::SetAdaptive).
+		float heat = 0;
 		// For a leaf node, this container stores the objects managed by this node.
 		// For a non-leaf node, this container is empty.
 		// The objects container itself is an unordered_set.
@@ -140,9 +288,20 @@ namespace Quadtree
 		//    for (auto [x, y, o] : objects)
 		//       // for each object o locates at position (x,y)
 		Objects<Object, ObjectHasher> objects;
+		// The id of this node, and the next node in the same bucket of the node table.
+		NodeId id = 0;
+		Node*  hnext = nullptr;
+		// The compressed edge: the deepest descendant (or itself) containing all the objects inside
+		// this node, following the chain of nodes with a single non-empty child.
+		// It's this node itself for a leaf node, an empty node, or a node with more than one
+		// non-empty children. Traversals collecting objects jump along it directly.
+		Node* skip;
 
-		Node(bool isLeaf, uint8_t d, int x1, int y1, int x2, int y2);
-		~Node();
+		// The containers allocate from given memory resource.
+		Node(bool isLeaf, uint8_t d, int x1, int y1, int x2, int y2,
+			std::pmr::memory_resource* mr = std::pmr::get_default_resource());
+		// Resets a recycled node to given state, the (empty) containers are kept with their capacity.
+		void Reset(bool isLeaf, uint8_t d, int x1, int y1, int x2, int y2);
 	};
 
 	// Collector is the function that can collect the managed objects.
@@ -150,10 +309,189 @@ namespace Quadtree
 	template <typename Object>
 	using Collector = std::function<void(int, int, Object)>;
 
+	// RectCollector is the function that can collect the managed rectangle objects.
+	// The arguments is (x1,y1,x2,y2,object), where [(x1,y1),(x2,y2)] is the rectangle of the object.
+	template <typename Object>
+	using RectCollector = std::function<void(int, int, int, int, Object)>;
+
+	// ObjectPredicate is the function to test an object, the arguments is (x,y,object), where the
+	// (x,y) is the position of the object.
+	template <typename Object>
+	using ObjectPredicate = std::function<bool(int, int, Object)>;
+
 	// Visitor is the function that can access a quadtree node.
 	template <typename Object, typename ObjectHasher = std::hash<Object>>
 	using Visitor = std::function<void(Node<Object, ObjectHasher>*)>;
 
+	// NodeTable is the hash table mapping node ids to nodes, replacing a std::unordered_map to avoid
+	// the latency spikes on growing.
+	// It's an intrusive chained hash table, the chains are linked via the nodes' hnext pointers, and
+	// the key is the node's id field, so inserting and erasing never allocate.
+	// On growing, a new bucket array of double size is allocated (by calloc, which is cheap for large
+	// zeroed memory), but the entries are moved from the old array incrementally: every Insert and
+	// Erase moves a few old buckets (MIGRATE_STEP), and Find looks up both arrays in the meantime.
+	// So no operation pays for rehashing the whole table.
+	template <typename NodeT>
+	class NodeTable
+	{
+	public:
+		NodeTable() = default;
+		~NodeTable();
+		NodeTable(const NodeTable&) = delete;
+		NodeTable& operator=(const NodeTable&) = delete;
+		NodeTable(NodeTable&& other) noexcept;
+		NodeTable& operator=(NodeTable&& other) noexcept;
+
+		// Returns the node with given id, nullptr if not found.
+		NodeT* Find(NodeId id) const;
+		// Prefetches the bucket of given id and the first node in it, for a Find later.
+		void Prefetch(NodeId id) const;
+		// Inserts given node, keyed by its id. The id should not exist in the table.
+		void Insert(NodeT* node);
+		// Erases the node with given id, returns the erased node, or nullptr if not found.
+		NodeT* Erase(NodeId id);
+		// Returns the number of nodes in the table.
+		std::size_t Size() const { return size; }
+		// Pre-sizes the table for n nodes, rehashes all entries at once.
+		void Reserve(std::size_t n);
+		// Returns the number of buckets, Reserve(Capacity()) on another table sizes it alike.
+		std::size_t Capacity() const { return cap; }
+		// Removes all entries, the nodes themselves are not touched.
+		void Clear();
+		// Calls fn(node) for each node in the table, the order is unstable.
+		template <typename Fn>
+		void ForEach(Fn&& fn) const;
+		// Sets the memory resource to allocate the bucket arrays from, nullptr (the default) to use
+		// calloc. It should be set on an empty table.
+		void SetMemoryResource(std::pmr::memory_resource* r) { mr = r; }
+
+	private:
+		// the number of old buckets to migrate on each Insert and Erase.
+		// The table grows again only after the size doubles, and a migration finishes within
+		// (old capacity / MIGRATE_STEP) operations, so it's always done in time.
+		static const std::size_t MIGRATE_STEP = 8;
+		// the minimum capacity.
+		static const std::size_t MIN_CAP = 8;
+
+		NodeT**		buckets = nullptr;
+		std::size_t cap = 0;
+		int			shift = 64;
+		// the old bucket array being migrated, buckets in [0, migrated) are already moved.
+		NodeT**		oldBuckets = nullptr;
+		std::size_t oldCap = 0, migrated = 0;
+		int			oldShift = 64;
+		// the number of nodes.
+		std::size_t size = 0;
+		// the memory resource of the bucket arrays, nullptr for calloc.
+		std::pmr::memory_resource* mr = nullptr;
+
+		static std::size_t Index(NodeId id, int shift) { return (id * 0x9e3779b97f4a7c15ULL) >> shift; }
+		static NodeT*	   Unlink(NodeT** chain, NodeId id);
+		void			   Allocate(std::size_t n);
+		void			   Migrate(std::size_t k);
+		void			   Release();
+		NodeT**			   NewBuckets(std::size_t n);
+		void			   FreeBuckets(NodeT** p, std::size_t n);
+	};
+
+	// AllocatorPolicy decides where a tree allocates its nodes from.
+	enum class AllocatorPolicy
+	{
+		// Each node is allocated by the global operator new.
+		Default,
+		// Nodes are allocated from 2 MiB chunks, backed by transparent huge pages on Linux via
+		// madvise(MADV_HUGEPAGE), to reduce TLB misses on large trees.
+		HugePages,
+		// Same to HugePages, but tries the reserved huge pages (mmap with MAP_HUGETLB) first, falls
+		// back to HugePages if there's none available.
+		HugeTLB,
+	};
+
+	// AdaptiveOptions configures the query-driven adaptive refinement, see Quadtree::SetAdaptive.
+	struct AdaptiveOptions
+	{
+		// A leaf node scanned by QueryRange gains 1 heat if at least this fraction of its objects are
+		// outside the query range.
+		float wasteRatio = 0.5f;
+		// Leaf nodes with fewer objects are never heated, scanning them is cheap anyway.
+		int minObjects = 4;
+		// A leaf node splits on Adapt once its heat reaches this value.
+		float splitHeat = 16;
+		// A split node stays split while its heat is at least this value, and merges back on Adapt
+		// after it cools down, unless the ssf still wants it to split.
+		float keepHeat = 1;
+		// The heat of each node is multiplied by this factor on each Adapt.
+		float decay = 0.5f;
+	};
+
+	// AutoTuneOptions configures the auto-tuning of the split threshold, see Quadtree::SetAutoTune.
+	struct AutoTuneOptions
+	{
+		// The initial threshold, and its bounds.
+		int threshold = 8;
+		int minThreshold = 1, maxThreshold = 64;
+		// The cost of creating or removing a node, relative to scanning a single object.
+		int restructureCost = 16;
+		// Tune adjusts the threshold only if at least this number of updates and queries observed.
+		int minSamples = 64;
+	};
+
+	// TuneStats is the chosen threshold and the workload observed, see Quadtree::GetTuneStats.
+	struct TuneStats
+	{
+		// The current threshold, a node with at most this number of objects stops to split.
+		int threshold = 0;
+		// The number of times the threshold changed.
+		int adjustments = 0;
+		// The workload observed since last Tune: the number of Add and Remove calls changing the
+		// objects, the number of QueryRange calls, the number of objects scanned in leaf nodes and
+		// those outside the query ranges, and the number of nodes created or removed by the Add and
+		// Remove calls.
+		int64_t updates = 0, queries = 0, scanned = 0, wasted = 0, restructures = 0;
+	};
+
+	// HugePageArena allocates fixed-size blocks from 2 MiB chunks, freed blocks are reused via a free
+	// list, and the chunks are released only on destruction.
+	// On Linux, a chunk is an mmap-ed region aligned to 2 MiB, so that the kernel is able to back it
+	// with a single huge page. On other platforms, or if mmap fails, a chunk is allocated by malloc.
+	class HugePageArena
+	{
+	public:
+		static const std::size_t CHUNK_SIZE = 2 << 20;
+
+		HugePageArena(std::size_t blockSize, bool hugetlb = false);
+		~HugePageArena();
+		HugePageArena(const HugePageArena&) = delete;
+		HugePageArena& operator=(const HugePageArena&) = delete;
+
+		// Returns a block of blockSize bytes, aligned to alignof(std::max_align_t).
+		void* Allocate();
+		// Puts given block back to the free list.
+		void Deallocate(void* p);
+		// Returns the number of chunks allocated.
+		std::size_t NumChunks() const { return chunks.size(); }
+		// Returns the number of chunks backed by the reserved huge pages (MAP_HUGETLB).
+		std::size_t NumHugeTLBChunks() const { return numHugeTLBChunks; }
+
+	private:
+		struct Chunk
+		{
+			void* p;
+			// how the chunk is allocated: 0 by malloc, 1 by mmap, 2 by mmap with MAP_HUGETLB.
+			int kind;
+		};
+		std::size_t		   blockSize;
+		bool			   hugetlb;
+		std::vector<Chunk> chunks;
+		std::size_t		   numHugeTLBChunks = 0;
+		// the bump pointer inside the last chunk, and its end.
+		char *cur = nullptr, *end = nullptr;
+		// the free list, linked via the first bytes of the free blocks.
+		void* freeList = nullptr;
+
+		void NewChunk();
+	};
+
 	template <typename Object>
 	struct BatchOperationItem
 	{
@@ -175,6 +513,9 @@ namespace Quadtree
 	public:
 		using NodeT = Node<Object, ObjectHasher>;
 		using CollectorT = Collector<Object>;
+		using PredicateT = ObjectPredicate<Object>;
+		using RectCollectorT = RectCollector<Object>;
+		using RectObjectsT = RectObjects<Object>;
 		using VisitorT = Visitor<Object, ObjectHasher>;
 		using ObjectsT = Objects<Object, ObjectHasher>;
 		using BatchOperationItemT = BatchOperationItem<Object>;
@@ -186,14 +527,33 @@ namespace Quadtree
 		);
 		~Quadtree();
 
+		// Quadtree is not copyable, since the nodes are owned via raw pointers, use Clone() instead.
+		Quadtree(const Quadtree&) = delete;
+		Quadtree& operator=(const Quadtree&) = delete;
+
+		// Quadtree is movable, the nodes are handed over without copying, and the moved-from tree
+		// becomes an empty tree without nodes (Build it again before use).
+		Quadtree(Quadtree&& other) noexcept;
+		Quadtree& operator=(Quadtree&& other) noexcept;
+
+		// Returns a deep copy of this tree, including all nodes, objects, rectangle objects, the ssf
+		// functions and the callbacks.
+		// The nodes are copied directly with their objects containers, without re-inserting objects
+		// or running the ssf, and the node table is pre-sized and filled with the copied nodes.
+		// The callbacks are not called for the copied leaf nodes.
+		Quadtree Clone() const;
+
 		// Returns the depth of the tree, starting from 0.
 		uint8_t Depth() const { return maxd; }
 
 		// Returns the total number of objects managed by this tree.
 		int NumObjects() const { return numObjects; }
 
+		// Returns the total number of rectangle objects managed by this tree.
+		int NumRects() const { return numRects; }
+
 		// Returns the number of nodes in this tree.
-		int NumNodes() const { return m.size(); }
+		int NumNodes() const { return m.Size(); }
 
 		// Returns the number of leaf nodes in this tree.
 		int NumLeafNodes() const { return numLeafNodes; }
@@ -211,7 +571,161 @@ namespace Quadtree
 		void SetAfterLeafRemovedCallback(VisitorT cb) { afterLeafRemoved = cb; }
 
 		// Returns the root node.
-		NodeT* GetRootNode() { return root; }
+		NodeT*		 GetRootNode() { return root; }
+		const NodeT* GetRootNode() const { return root; }
+
+		// Reserve prepares the tree for a steady state without allocations on restructuring:
+		// 1. The node table is pre-sized for expectedNodes nodes, so it won't rehash until the tree
+		//    grows larger.
+		// 2. Nodes are pre-allocated into a pool, each with objects container pre-sized for
+		//    expectedObjectsPerLeaf objects.
+		// 3. The recycling mode is turned on: removed nodes go back to the pool with their containers
+		//    (which keep their capacity) instead of being freed, and new nodes are taken from the
+		//    pool first. The pool is freed on the tree's destruction.
+		// Notes that the objects containers are node-based hash sets, inserting an object still
+		// allocates a hash node.
+		void Reserve(int expectedNodes, int expectedObjectsPerLeaf = 0);
+
+		// Returns the number of nodes in the pool waiting to be recycled.
+		int NumPooledNodes() const { return pool.size(); }
+
+		// SetAllocatorPolicy decides where to allocate the nodes from, see AllocatorPolicy.
+		// It should be set on an empty tree, before Build and Reserve, otherwise it's ignored.
+		// Notes that the objects containers still allocate their hash nodes from the global heap.
+		void SetAllocatorPolicy(AllocatorPolicy p);
+
+		// Returns the arena allocating the nodes, nullptr for the default policy.
+		const HugePageArena* GetNodeArena() const { return arena.get(); }
+
+		// SetMemoryResource sets the memory resource to allocate from, for the nodes, the objects
+		// containers and rectangle objects containers inside nodes, and the node table's buckets.
+		// e.g. a std::pmr::monotonic_buffer_resource for a per-frame tree, or an adapter of an
+		// engine's allocator to account the memory used by the tree.
+		// It should be set on an empty tree, before Build and Reserve, otherwise it's ignored. The
+		// resource should outlive the tree (and its clones, which share the same resource).
+		// If an allocator policy other than the default is set, the nodes themselves are still
+		// allocated from the arena, but the containers inside them use this resource.
+		// nullptr (the default) means the global operator new, and the default resource for the
+		// containers.
+		void SetMemoryResource(std::pmr::memory_resource* r);
+
+		// Returns the memory resource set by SetMemoryResource, nullptr for the default.
+		std::pmr::memory_resource* GetMemoryResource() const { return mr; }
+
+		// SetBudget turns on the budgeted mode if the given budget is positive, or turns it off if
+		// it's 0 (the default).
+		// In budgeted mode, each spliting or merging triggered by a single call (e.g. Add, Remove)
+		// does at most budget units of work: creating a node during spliting costs 1, merging 4
+		// children into their parent costs 1. The nodes still to split or merge are left as leaf nodes
+		// and queued, to be continued by Step() later.
+		// A leaf node waiting in the queue just manages more (or less) objects than the ssf wants,
+		// the tree stays valid, so all queries remain correct on the partially restructured tree.
+		// Notes that at least one level of spliting (4 children) or merging is done per call, and the
+		// budget is checked before spliting a node further, the 4 children of a node are always
+		// created together, so a call may exceed the budget by up to 3 nodes per level.
+		void SetBudget(int b) { budget = b; }
+
+		// Step continues the queued splitings and mergings, with given budget of work units.
+		// Returns the number of nodes still waiting in the queue.
+		// The callbacks are called the same way as the restructuring in Add and Remove.
+		int Step(int budget);
+
+		// Returns the number of nodes waiting in the restructuring queue, including stale ones.
+		int NumPendingNodes() const { return pending.size(); }
+
+		// SetSparse turns on (or off) the sparse mode, it should be set before Build.
+		// In sparse mode, empty leaf nodes are not materialised: spliting creates only the children
+		// containing objects, and a leaf node turning empty on removal is removed from its parent
+		// (and so are its ancestors turning into empty leaf nodes). An absent child is an implicit
+		// empty leaf node, it's created on demand when an object is added into it.
+		// So the number of nodes is proportional to the number of objects, instead of the grid's
+		// size, for huge sparse grids with ssf like `n <= k`.
+		// Notes that in sparse mode:
+		// 1. Find returns nullptr for the positions inside implicit empty leaf nodes.
+		// 2. QueryLeafNodesInRange and FindNeighbourLeafNodes don't visit implicit empty leaf nodes.
+		// 3. A non-leaf node may have no children, if all of them are empty while the ssf still wants
+		//    it to split.
+		void SetSparse(bool b) { sparse = b; }
+
+		// SetOccupancyBitmaps turns on (or off) the occupancy bitmaps, it should be set before Build.
+		// Each leaf node with at most 8x8 cells maintains a 64-bit bitmap of its cells occupied by
+		// objects, so that IsCellOccupied, IsRectEmpty and FirstOccupiedCellInRow answer with a few
+		// bit operations on such leaf nodes, and QueryRange skips the leaf nodes without objects
+		// inside the range without scanning them.
+		// Notes that the rectangle objects don't occupy cells.
+		void SetOccupancyBitmaps(bool b) { occupancyBitmaps = b; }
+
+		// SetAdaptive turns on (or off) the query-driven adaptive refinement.
+		// The ssf only sees the objects, so the shape of the tree ignores where the queries are. In
+		// adaptive mode, a leaf node gains heat each time QueryRange scans it but finds most of its
+		// objects outside the range, and a split node gains heat each time a query overlaps it
+		// partially. Calls Adapt periodically (e.g. once per frame) to apply the heats:
+		// 1. A hot leaf node splits, even if the ssf wants it to stop.
+		// 2. The heats decay, a split node cooling down merges back if the ssf wants it to stop.
+		// A hot node won't be merged by Add, Remove or other restructurings.
+		// Notes that QueryRange modifies the heats in adaptive mode, so it's not safe to call it
+		// concurrently any more.
+		void SetAdaptive(bool b, const AdaptiveOptions& options = AdaptiveOptions())
+		{
+			adaptive = b, adaptiveOptions = options;
+		}
+
+		// Splits the hot leaf nodes and merges the cold nodes back, and decays the heats, see
+		// SetAdaptive. The hook functions are called for the created and removed leaf nodes.
+		// Returns the number of nodes split or merged.
+		int Adapt();
+
+		// SetAutoTune turns on (or off) the auto-tuning of the split threshold.
+		// A low threshold means restructuring churn on updates, a high threshold means slow leaf
+		// scans on queries. In auto-tuning mode, a node with at most threshold objects stops to
+		// split, besides the ssf, so the ssf should only express the other constraints (e.g. the
+		// minimal size). The tree counts the costs of the both sides, and Tune, called periodically,
+		// doubles or halves the threshold within the bounds towards the cheaper side.
+		// Notes that QueryRange modifies the counters in auto-tuning mode, so it's not safe to call
+		// it concurrently any more.
+		void SetAutoTune(bool b, const AutoTuneOptions& options = AutoTuneOptions());
+
+		// Adjusts the threshold by the workload observed since last call, and resets the counters.
+		// If the threshold changes, all leaf nodes are queued to restructure, call Step to rebalance
+		// the tree incrementally.
+		// Returns true if the threshold changes.
+		bool Tune();
+
+		// Returns the chosen threshold and the workload observed, see SetAutoTune. To freeze the
+		// threshold, turns off auto-tuning and uses it in the ssf.
+		const TuneStats& GetTuneStats() const { return tuneStats; }
+
+		// StartRebuild starts to rebuild a fresh tree from the current objects and rectangle objects
+		// on a worker thread, by adding all objects into the root at once and splitting it down,
+		// while this tree keeps serving as usual. The mutations (Add, Remove, RemoveObjects,
+		// RemoveIfInRange and its variants, AddRect, RemoveRect and BatchAddToLeafNode) during the
+		// rebuild are logged, to be replayed onto the fresh tree by FinishRebuild. RemoveIfInRange and
+		// RemoveIf log the objects removed, their predicates aren't called again.
+		// The objects are copied on the calling thread. The settings are copied to the fresh tree, its
+		// ssf functions are called on the worker thread, so they (and the memory resource, if set)
+		// must be thread-safe.
+		// Returns false if a rebuild is already in progress, or the tree is not built.
+		bool StartRebuild();
+
+		// Returns true if a rebuild is in progress.
+		bool IsRebuilding() const { return rebuild != nullptr; }
+
+		// Returns true if the worker thread has done building, FinishRebuild won't block then.
+		bool IsRebuildReady() const;
+
+		// FinishRebuild waits for the worker thread, replays the logged mutations onto the fresh tree,
+		// and swaps it in by moving, the old tree is freed on another thread, or on the calling
+		// thread if a memory resource is set.
+		// The hook functions are called for the difference: afterLeafRemoved for the old leaf nodes
+		// absent in the new tree, and then afterLeafCreated for the new leaf nodes absent in the old
+		// tree. The old nodes are still alive during the afterLeafRemoved calls. A leaf node of the
+		// same region in both trees isn't reported, but it's a different node afterwards, so identify
+		// leaf nodes by their ids rather than pointers across a rebuild.
+		// The recycling mode and the pool of free nodes carry over, the heats of adaptive mode and the
+		// queue of budgeted mode are dropped.
+		// If the worker thread throws, rethrows it, the rebuild is abandoned and this tree is kept.
+		// Returns false if there's no rebuild in progress.
+		bool FinishRebuild();
 
 		// Build all nodes recursively on an empty quadtree.
 		// This build function must be called on an **empty** quadtree,
@@ -220,9 +734,24 @@ namespace Quadtree
 
 		// Find the leaf node managing given position (x,y).
 		// If the given position crosses the bound, returns nullptr.
-		// We use binary-search for optimization, the time complexity is O(log Depth).
+		// It's FindByDescent if the depth of the tree is not larger than the threshold set by
+		// SetFindDescentDepth, otherwise FindByDepthSearch.
 		NodeT* Find(int x, int y) const;
 
+		// Find the leaf node by binary-search on depth, probing the node table once per step, the
+		// time complexity is O(log Depth), each probe is a potential cache miss.
+		NodeT* FindByDepthSearch(int x, int y) const;
+
+		// Find the leaf node by descending from the root, choosing the child via the middle point
+		// stored in the node, the time complexity is O(Depth), but each step is a pointer chasing
+		// without hashing, it's faster for shallow trees.
+		NodeT* FindByDescent(int x, int y) const;
+
+		// Sets the max depth of the tree for Find to descend from the root instead of the binary
+		// search on depth. Defaults to 12, set -1 to always use the binary search, or MAX_DEPTH to
+		// always descend.
+		void SetFindDescentDepth(int d) { findDescentDepth = d; }
+
 		// Add a object located at position (x,y) to the right leaf node.
 		// And split down if the node is able to continue the spliting after the insertion.
 		// Or merge up if the node's parent is able to be a leaf node instead.
@@ -246,6 +775,53 @@ namespace Quadtree
 		// Dose nothing if this object dose not exist at given position.
 		void RemoveObjects(int x, int y);
 
+		// RemoveRange removes all objects inside given rectangular range.
+		// The parameters (x1,y1) and (x2,y2) are the left-top and right-bottom corners of the given
+		// rectangle.
+		// Does nothing if x1 <= x2 && y1 <= y2 is not satisfied.
+		// We will limit the range to within the valid grid.
+		//
+		// A node fully covered by the range is collapsed into a single empty leaf node in one step,
+		// without visiting its descendants' objects one by one. Only the leaf nodes crossing the range's
+		// edges are filtered. And then the affected nodes are merged or split in a single bottom-up
+		// pass, instead of a restructure after each removal.
+		void RemoveRange(int x1, int y1, int x2, int y2);
+
+		// RemoveIf removes all objects satisfying given predicate, i.e. pred(x,y,o) returns true.
+		// The objects are filtered in place inside each leaf node, and then the affected nodes are
+		// merged or split in a single bottom-up pass, the same to RemoveRange. This is much faster than
+		// calling Remove() for each object.
+		void RemoveIf(PredicateT& pred);
+		void RemoveIf(PredicateT&& pred);
+
+		// RemoveIfInRange removes the objects inside given rectangular range satisfying given predicate.
+		// Only the nodes overlapping with the range are visited.
+		// Does nothing if x1 <= x2 && y1 <= y2 is not satisfied.
+		// We will limit the range to within the valid grid.
+		void RemoveIfInRange(int x1, int y1, int x2, int y2, PredicateT& pred);
+		void RemoveIfInRange(int x1, int y1, int x2, int y2, PredicateT&& pred);
+
+		// Add a rectangle object o occupying the rectangle [(x1,y1), (x2,y2)].
+		// The object is stored only once, in the smallest node enclosing the rectangle, so it's
+		// counted once by the ssf function of this node and its ancestors, and is reported once by
+		// QueryRectsInRange. A rectangle object moves down to a child on spliting if the child encloses
+		// it, and moves up to the parent on merging.
+		// Does nothing if x1 <= x2 && y1 <= y2 is not satisfied, or the rectangle crosses the boundary.
+		// Dose nothing if this object already exist at given rectangle.
+		void AddRect(int x1, int y1, int x2, int y2, Object o);
+
+		// Remove the rectangle object o occupying the rectangle [(x1,y1), (x2,y2)].
+		// Dose nothing if this object dose not exist at given rectangle.
+		void RemoveRect(int x1, int y1, int x2, int y2, Object o);
+
+		// Query the rectangle objects overlapping with given rectangular range, the given collector
+		// will be called once for each object hits.
+		// Does nothing if x1 <= x2 && y1 <= y2 is not satisfied.
+		// We will limit the query range to within the valid grid.
+		// The subtrees without rectangle objects are skipped.
+		void QueryRectsInRange(int x1, int y1, int x2, int y2, RectCollectorT& collector) const;
+		void QueryRectsInRange(int x1, int y1, int x2, int y2, RectCollectorT&& collector) const;
+
 		// Query the objects inside given rectangular range, the given collector will be called
 		// for each object hits.
 		//
@@ -261,6 +837,21 @@ namespace Quadtree
 		void QueryRange(int x1, int y1, int x2, int y2, CollectorT& collector) const;
 		void QueryRange(int x1, int y1, int x2, int y2, CollectorT&& collector) const;
 
+		// Returns true if there's any object at cell (x,y).
+		// Returns false if the given position crosses the bound.
+		bool IsCellOccupied(int x, int y) const;
+
+		// Returns true if there's no object inside given rectangular range.
+		// Returns true if x1 <= x2 && y1 <= y2 is not satisfied.
+		// We will limit the range to within the valid grid.
+		// Nodes without objects, or with bounding boxes of objects not overlapping the range are
+		// skipped, and a non-empty node fully covered answers false immediately.
+		bool IsRectEmpty(int x1, int y1, int x2, int y2) const;
+
+		// Returns the smallest x in [x1, x2] that cell (x,y) is occupied, or -1 if there's none.
+		// We will limit the range to within the valid grid.
+		int FirstOccupiedCellInRow(int y, int x1, int x2) const;
+
 		// Quert the leaf nodes overlapping with  given rectangular range, the given visitor will be
 		// called for each leaf nodes hits. The parameters (x1,y1) and (x2,y2) are the left-top and
 		// right-bottom corners of the given rectangle.
@@ -321,10 +912,53 @@ namespace Quadtree
 		// something like: BatchAddToLeafNode(GetRootNode(), allObjectItems).
 		void BatchAddToLeafNode(NodeT* leafNode, const std::vector<BatchOperationItemT>& items);
 
+		// Picks k objects uniformly at random from the objects inside given rectangular range, the
+		// given collector will be called for each sample. The samples are drawn independently, that is
+		// with replacement, so the same object may be collected more than once.
+		// The rng is an uniform random bit generator, e.g. std::mt19937.
+		//
+		// Does nothing if x1 <= x2 && y1 <= y2 is not satisfied, or there's no objects inside the range.
+		// We will limit the query range to within the valid grid.
+		//
+		// We first collect the nodes fully covered by the range (and the objects inside the range from
+		// the partially covered leaf nodes at the edges), and then for each sample, we pick one of them
+		// weighted by its objects counter, and descend down to a leaf proportionally to the children's
+		// counters. Time complexity: O(C + k*(log C + D)), where C is the number of nodes overlapping
+		// the range's edges and D is the depth of the tree.
+		template <typename RNG>
+		void SampleRange(int x1, int y1, int x2, int y2, int k, RNG& rng, CollectorT& collector) const;
+		template <typename RNG>
+		void SampleRange(int x1, int y1, int x2, int y2, int k, RNG& rng, CollectorT&& collector) const;
+
+		// Exports the number of objects on a coarse grid, of which each cell covers cellSize x cellSize
+		// cells of the tree's region.
+		// The out raster is resized to gw*gh in row-major order, where gw = ceil(w/cellSize) and
+		// gh = ceil(h/cellSize), and out[gy*gw+gx] is the number of objects inside the coarse cell
+		// (gx,gy), i.e. inside the rectangle [(gx*cellSize, gy*cellSize), ((gx+1)*cellSize-1,
+		// (gy+1)*cellSize-1)].
+		// Does nothing if cellSize <= 0.
+		//
+		// The nodes fully inside a coarse cell contribute their objects counter in O(1), only the leaf
+		// nodes crossing the coarse cells' edges are scanned.
+		void ExportDensity(int cellSize, std::vector<int>& out) const;
+
+		// Query the nodes overlapping with given rectangular range in a level-of-detail manner, the
+		// given visitor will be called for each node hits.
+		// Different from QueryLeafNodesInRange, we stop descending at depth maxDepth, a non-leaf node
+		// at this depth is visited as a whole cluster, its clustering informations (n, the centroid
+		// (sx/n, sy/n) and the bounding box (bx1,by1,bx2,by2)) describe all the objects inside it.
+		// Empty nodes (n == 0) are skipped.
+		//
+		// Does nothing if x1 <= x2 && y1 <= y2 is not satisfied.
+		// We will limit the query range to within the valid grid.
+		// Notes that a visited node may cover objects outside the query range.
+		void QueryRangeLOD(int x1, int y1, int x2, int y2, int maxDepth, VisitorT& visitor) const;
+		void QueryRangeLOD(int x1, int y1, int x2, int y2, int maxDepth, VisitorT&& visitor) const;
+
 	private:
 		NodeT* root = nullptr;
 		// width and height of the whole region.
-		const int w, h;
+		int w, h;
 		// maxd is the current maximum depth.
 		uint8_t maxd = 0;
 		// numDepthTable records how many nodes reaches every depth.
@@ -333,32 +967,124 @@ namespace Quadtree
 		int numObjects = 0;
 		// the number of leaf nodes in this tree.
 		int numLeafNodes = 0;
+		// the number of rectangle objects in this tree.
+		int numRects = 0;
 		// the function to test if a node should stop to split.
 		SplitingStopper ssf = nullptr;
 		// ssfv2 takes higher priority than ssf v1.
 		// if ssfv2 is not nullptr, ssf v1 won't be used anymore.
 		SplitingStopperV2 ssfv2 = nullptr;
 		// cache the mappings between id and the node.
-		std::unordered_map<NodeId, NodeT*> m;
+		NodeTable<NodeT> m;
 		// callback functions
 		VisitorT afterLeafCreated = nullptr, afterLeafRemoved = nullptr;
+		// recycling mode, turned on by Reserve().
+		bool recycle = false;
+		// sparse mode, see SetSparse().
+		bool sparse = false;
+		// the max depth for Find to descend from the root, see SetFindDescentDepth().
+		int findDescentDepth = 12;
+		// whether to maintain the occupancy bitmaps, see SetOccupancyBitmaps().
+		bool occupancyBitmaps = false;
+		// adaptive mode and its options, see SetAdaptive().
+		bool			adaptive = false;
+		AdaptiveOptions adaptiveOptions;
+		// the ids of the nodes with heat, or cold nodes waiting to merge back, maybe stale or
+		// duplicate, tidied up by Adapt.
+		mutable std::vector<NodeId> warm;
+		// auto-tuning mode, its options and counters, see SetAutoTune().
+		bool			  autoTune = false;
+		AutoTuneOptions	  tuneOptions;
+		mutable TuneStats tuneStats;
+		// the number of nodes ever created or removed, updates count their share by the difference.
+		int64_t churn = 0;
+		// the state of an ongoing rebuild, see StartRebuild().
+		struct Rebuild
+		{
+			// the fresh tree, and the worker building it, which is waited first on destruction.
+			std::unique_ptr<Quadtree> tree;
+			std::future<void>		  worker;
+			// the mutations since the rebuild starts, to replay onto the fresh tree.
+			std::vector<std::function<void(Quadtree&)>> log;
+		};
+		std::unique_ptr<Rebuild> rebuild;
+		// freeing the old tree after a rebuild.
+		std::future<void> reclaim;
+		// the pool of free nodes to recycle.
+		std::vector<NodeT*> pool;
+		// the allocator policy, and the arena to allocate nodes from if it's not the default.
+		AllocatorPolicy				   policy = AllocatorPolicy::Default;
+		std::unique_ptr<HugePageArena> arena;
+		// the memory resource to allocate from, nullptr for the default.
+		std::pmr::memory_resource* mr = nullptr;
+		// the work budget per call in budgeted mode, 0 for unlimited.
+		int budget = 0;
+		// the work units left for current call.
+		int workLeft = INT_MAX;
+		// the ids of the leaf nodes waiting to split or merge in budgeted mode.
+		// Keyed by id since the nodes may be removed before Step reaches them.
+		std::deque<NodeId> pending;
 
 		// ~~~~~~~~~~~ Internals ~~~~~~~~~~~~~
 		using NodeSet = std::unordered_set<NodeT*>;
+		// scratch sets reused by the restructuring procedures to keep their buckets.
+		NodeSet scratchCreatedLeafNodes, scratchRemovedLeafNodes;
+		void   ClearPool();
+		NodeT* NewNode(bool isLeaf, uint8_t d, int x1, int y1, int x2, int y2);
+		void   FreeNode(NodeT* node);
+		void   FreeNodes(NodeT* node);
+		void   MoveFrom(Quadtree& other);
+		void   CopySettings(Quadtree& dst) const;
+		NodeT* CloneHelper(const NodeT* node, NodeT* parent, Quadtree& dst) const;
 		NodeT* ParentOf(NodeT* node) const;
 		bool   IsSplitable(int x1, int y1, int x2, int y2, int n) const;
 		NodeT* CreateNode(bool isLeaf, uint8_t d, int x1, int y1, int x2, int y2);
 		void   RemoveLeafNode(NodeT* node);
 		bool   TrySplitDown(NodeT* node);
 		bool   TryMergeUp(NodeT* node);
+		bool   SplitDown(NodeT* node);
+		bool   MergeUp(NodeT* node);
+		NodeT* SkipOf(NodeT* node) const;
+		void   UpdateSkips(NodeT* node) const;
+		NodeT* Materialize(NodeT* node, int x1, int y1, int x2, int y2);
+		void   PruneEmptyLeafNode(NodeT* node, NodeSet& createdLeafNodes, NodeSet& removedLeafNodes);
+		void   TryPrune(int x1, int y1, int x2, int y2);
+		bool   HasOccupancy(const NodeT* node) const;
+		void   SyncOccupancy(NodeT* node) const;
+		void   Heat(NodeT* node) const;
+		bool   IsHot(const NodeT* node) const;
+		void   QueueLeafNodes();
+		bool   IsRectEmptyHelper(const NodeT* node, int x1, int y1, int x2, int y2) const;
+		int	   FirstOccupiedCellInRowHelper(const NodeT* node, int y, int x1, int x2) const;
 		NodeT* SplitHelper1(uint8_t d, int x1, int y1, int x2, int y2, ObjectsT& upstreamObjects,
-			NodeSet& createdLeafNodes);
+			RectObjectsT& upstreamRects, NodeSet& createdLeafNodes);
 		void   SplitHelper2(NodeT* node, NodeSet& createdLeafNodes);
 		bool   IsMergeable(NodeT* node, NodeT*& parent) const;
 		NodeT* MergeHelper(NodeT* node, NodeSet& removedLeafNodes);
 		void   QueryRange(NodeT* node, CollectorT& objectsCollector, VisitorT& nodeVisitor, int x1, int y1,
 			  int x2, int y2) const;
 		NodeT* FindSmallestNodeCoveringRangeHelper(int x1, int y1, int x2, int y2, int dma) const;
+		void   UpdateStatsByScan(NodeT* node) const;
+		void   UpdateNumRects(NodeT* node, int delta);
+		void   TrySyncNonLeafNode(NodeT* node);
+		void   CollectRects(NodeT* node, RectObjectsT& rects) const;
+		void   QueryRectsInRange(NodeT* node, int x1, int y1, int x2, int y2,
+			  RectCollectorT& collector) const;
+		void   UpdateStatsByChildren(NodeT* node) const;
+		void   RemoveSubtree(NodeT* node, NodeSet& createdLeafNodes, NodeSet& removedLeafNodes);
+		void   MergeChildren(NodeT* node, NodeSet& createdLeafNodes, NodeSet& removedLeafNodes);
+		void   Restructure(NodeT* node, NodeSet& createdLeafNodes, NodeSet& removedLeafNodes);
+		void   AfterRestructure(NodeSet& createdLeafNodes, NodeSet& removedLeafNodes);
+		int	   RemoveRangeHelper(NodeT* node, int x1, int y1, int x2, int y2, PredicateT& pred,
+			   NodeSet& createdLeafNodes, NodeSet& removedLeafNodes);
+		bool   UpdateBoundingBox(NodeT* node) const;
+		void   PropagateAdd(NodeT* node, int n, int64_t sx, int64_t sy, int bx1, int by1, int bx2, int by2);
+		void   PropagateRemove(NodeT* node, int x, int y, int n);
+		void   QueryRangeLOD(NodeT* node, int x1, int y1, int x2, int y2, int maxDepth,
+			  VisitorT& visitor) const;
+		void   ExportDensityHelper(NodeT* node, int cellSize, int gw, std::vector<int>& out) const;
+		void   CollectRangeCover(NodeT* node, int x1, int y1, int x2, int y2, std::vector<NodeT*>& fullNodes,
+			  std::vector<ObjectKey<Object>>& edgeObjects) const;
 		// ~~~~~~~~~~~~~ Internals::FindNeighbourLeafNodes ~~~~~~~~~~~~
 		void FindNeighbourLeafNodesDiagonal(NodeT* node, int direction, VisitorT& visitor) const;
 		void FindNeighbourLeafNodesHV(NodeT* node, int direction, VisitorT& visitor) const;
@@ -376,11 +1102,330 @@ namespace Quadtree
 		return x == other.x && y == other.y && o == other.o;
 	}
 
+	template <typename Object>
+	bool RectObjectKey<Object>::operator==(const RectObjectKey& other) const
+	{
+		return x1 == other.x1 && y1 == other.y1 && x2 == other.x2 && y2 == other.y2 && o == other.o;
+	}
+
+	template <typename NodeT>
+	NodeTable<NodeT>::~NodeTable()
+	{
+		Release();
+	}
+
+	template <typename NodeT>
+	NodeTable<NodeT>::NodeTable(NodeTable&& other) noexcept
+	{
+		*this = std::move(other);
+	}
+
+	template <typename NodeT>
+	NodeTable<NodeT>& NodeTable<NodeT>::operator=(NodeTable&& other) noexcept
+	{
+		if (this != &other)
+		{
+			Release();
+			mr = other.mr;
+			buckets = other.buckets, cap = other.cap, shift = other.shift;
+			oldBuckets = other.oldBuckets, oldCap = other.oldCap, migrated = other.migrated;
+			oldShift = other.oldShift, size = other.size;
+			other.buckets = other.oldBuckets = nullptr;
+			other.cap = other.oldCap = other.migrated = other.size = 0;
+			other.shift = other.oldShift = 64;
+		}
+		return *this;
+	}
+
+	template <typename NodeT>
+	void NodeTable<NodeT>::Release()
+	{
+		FreeBuckets(buckets, cap);
+		FreeBuckets(oldBuckets, oldCap);
+		buckets = oldBuckets = nullptr;
+		cap = oldCap = migrated = size = 0;
+		shift = oldShift = 64;
+	}
+
+	template <typename NodeT>
+	void NodeTable<NodeT>::Clear()
+	{
+		if (buckets != nullptr)
+			memset(buckets, 0, cap * sizeof(NodeT*));
+		FreeBuckets(oldBuckets, oldCap);
+		oldBuckets = nullptr;
+		oldCap = migrated = size = 0;
+	}
+
+	template <typename NodeT>
+	NodeT* NodeTable<NodeT>::Find(NodeId id) const
+	{
+		if (size == 0)
+			return nullptr;
+		for (auto p = buckets[Index(id, shift)]; p != nullptr; p = p->hnext)
+			if (p->id == id)
+				return p;
+		// the node may stay in a not-yet-migrated old bucket.
+		if (oldBuckets != nullptr)
+		{
+			for (auto p = oldBuckets[Index(id, oldShift)]; p != nullptr; p = p->hnext)
+				if (p->id == id)
+					return p;
+		}
+		return nullptr;
+	}
+
+	template <typename NodeT>
+	void NodeTable<NodeT>::Prefetch(NodeId id) const
+	{
+		if (size == 0)
+			return;
+		// a load of the bucket, doesn't wait on the pending loads of other probes.
+		auto p = buckets[Index(id, shift)];
+		if (p != nullptr)
+			::Quadtree::Prefetch(p);
+	}
+
+	// Allocates a new bucket array with capacity n (a power of 2), the current array turns to be the
+	// old array to migrate. There should be no migration in progress.
+	template <typename NodeT>
+	void NodeTable<NodeT>::Allocate(std::size_t n)
+	{
+		oldBuckets = buckets, oldCap = cap, oldShift = shift, migrated = 0;
+		buckets = NewBuckets(n);
+		cap = n, shift = 64;
+		while (n > 1)
+			n >>= 1, --shift;
+		if (oldCap == 0)
+		{
+			FreeBuckets(oldBuckets, oldCap);
+			oldBuckets = nullptr;
+		}
+	}
+
+	// Allocates a zeroed bucket array with capacity n.
+	template <typename NodeT>
+	NodeT** NodeTable<NodeT>::NewBuckets(std::size_t n)
+	{
+		if (mr == nullptr)
+			return static_cast<NodeT**>(std::calloc(n, sizeof(NodeT*)));
+		auto p = static_cast<NodeT**>(mr->allocate(n * sizeof(NodeT*), alignof(NodeT*)));
+		memset(p, 0, n * sizeof(NodeT*));
+		return p;
+	}
+
+	template <typename NodeT>
+	void NodeTable<NodeT>::FreeBuckets(NodeT** p, std::size_t n)
+	{
+		if (mr == nullptr)
+			std::free(p);
+		else if (p != nullptr)
+			mr->deallocate(p, n * sizeof(NodeT*), alignof(NodeT*));
+	}
+
+	// Moves at most k old buckets into the new array.
+	template <typename NodeT>
+	void NodeTable<NodeT>::Migrate(std::size_t k)
+	{
+		if (oldBuckets == nullptr)
+			return;
+		for (; k > 0 && migrated < oldCap; --k, ++migrated)
+		{
+			for (auto p = oldBuckets[migrated]; p != nullptr;)
+			{
+				auto next = p->hnext;
+				auto& head = buckets[Index(p->id, shift)];
+				p->hnext = head;
+				head = p;
+				p = next;
+			}
+			oldBuckets[migrated] = nullptr;
+		}
+		if (migrated == oldCap)
+		{
+			FreeBuckets(oldBuckets, oldCap);
+			oldBuckets = nullptr;
+			oldCap = migrated = 0;
+		}
+	}
+
+	template <typename NodeT>
+	void NodeTable<NodeT>::Insert(NodeT* node)
+	{
+		if (size + 1 > cap)
+		{
+			// the previous migration should be finished here, finish it anyway for safety.
+			Migrate(oldCap);
+			Allocate(cap == 0 ? MIN_CAP : cap * 2);
+		}
+		auto& head = buckets[Index(node->id, shift)];
+		node->hnext = head;
+		head = node;
+		++size;
+		Migrate(MIGRATE_STEP);
+	}
+
+	template <typename NodeT>
+	NodeT* NodeTable<NodeT>::Unlink(NodeT** chain, NodeId id)
+	{
+		for (; *chain != nullptr; chain = &(*chain)->hnext)
+		{
+			if ((*chain)->id == id)
+			{
+				auto p = *chain;
+				*chain = p->hnext;
+				p->hnext = nullptr;
+				return p;
+			}
+		}
+		return nullptr;
+	}
+
+	template <typename NodeT>
+	NodeT* NodeTable<NodeT>::Erase(NodeId id)
+	{
+		if (size == 0)
+			return nullptr;
+		auto p = Unlink(&buckets[Index(id, shift)], id);
+		if (p == nullptr && oldBuckets != nullptr)
+			p = Unlink(&oldBuckets[Index(id, oldShift)], id);
+		if (p != nullptr)
+			--size;
+		Migrate(MIGRATE_STEP);
+		return p;
+	}
+
+	template <typename NodeT>
+	void NodeTable<NodeT>::Reserve(std::size_t n)
+	{
+		if (n <= cap)
+			return;
+		std::size_t c = MIN_CAP;
+		while (c < n)
+			c <<= 1;
+		Migrate(oldCap);
+		Allocate(c);
+		Migrate(oldCap);
+	}
+
+	template <typename NodeT>
+	template <typename Fn>
+	void NodeTable<NodeT>::ForEach(Fn&& fn) const
+	{
+		for (std::size_t i = 0; i < cap; i++)
+			for (auto p = buckets[i]; p != nullptr; p = p->hnext)
+				fn(p);
+		if (oldBuckets != nullptr)
+		{
+			for (std::size_t i = migrated; i < oldCap; i++)
+				for (auto p = oldBuckets[i]; p != nullptr; p = p->hnext)
+					fn(p);
+		}
+	}
+
+	inline HugePageArena::HugePageArena(std::size_t blockSize, bool hugetlb)
+		: hugetlb(hugetlb)
+	{
+		// rounds up to keep every block aligned, and large enough to link the free list.
+		const std::size_t a = alignof(std::max_align_t);
+		blockSize = std::max(blockSize, sizeof(void*));
+		this->blockSize = (blockSize + a - 1) / a * a;
+	}
+
+	inline HugePageArena::~HugePageArena()
+	{
+		for (auto& c : chunks)
+		{
+#if defined(__linux__)
+			if (c.kind != 0)
+			{
+				munmap(c.p, CHUNK_SIZE);
+				continue;
+			}
+#endif
+			std::free(c.p);
+		}
+	}
+
+	inline void* HugePageArena::Allocate()
+	{
+		if (freeList != nullptr)
+		{
+			auto p = freeList;
+			freeList = *static_cast<void**>(p);
+			return p;
+		}
+		if (cur == nullptr || cur + blockSize > end)
+			NewChunk();
+		auto p = cur;
+		cur += blockSize;
+		return p;
+	}
+
+	inline void HugePageArena::Deallocate(void* p)
+	{
+		*static_cast<void**>(p) = freeList;
+		freeList = p;
+	}
+
+	inline void HugePageArena::NewChunk()
+	{
+		void* p = nullptr;
+		int	  kind = 0;
+#if defined(__linux__)
+	#if defined(MAP_HUGETLB)
+		// the reserved huge pages, fails if there's none.
+		if (hugetlb)
+		{
+			p = mmap(nullptr, CHUNK_SIZE, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			if (p == MAP_FAILED)
+				p = nullptr;
+			else
+				kind = 2;
+		}
+	#endif
+		if (p == nullptr)
+		{
+			// maps twice the size, and trims it to a 2 MiB aligned region.
+			auto q = mmap(nullptr, 2 * CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+				-1, 0);
+			if (q != MAP_FAILED)
+			{
+				auto s = reinterpret_cast<std::uintptr_t>(q);
+				auto t = (s + CHUNK_SIZE - 1) & ~(std::uintptr_t)(CHUNK_SIZE - 1);
+				if (t > s)
+					munmap(q, t - s);
+				if (t + CHUNK_SIZE < s + 2 * CHUNK_SIZE)
+					munmap(reinterpret_cast<void*>(t + CHUNK_SIZE), s + CHUNK_SIZE - t);
+				p = reinterpret_cast<void*>(t);
+				kind = 1;
+	#if defined(MADV_HUGEPAGE)
+				// just a hint, ignores the failure.
+				madvise(p, CHUNK_SIZE, MADV_HUGEPAGE);
+	#endif
+			}
+		}
+#endif
+		if (p == nullptr)
+		{
+			p = std::malloc(CHUNK_SIZE);
+			if (p == nullptr)
+				throw std::bad_alloc();
+		}
+		chunks.push_back({ p, kind });
+		if (kind == 2)
+			++numHugeTLBChunks;
+		cur = static_cast<char*>(p);
+		end = cur + CHUNK_SIZE;
+	}
+
 	const std::size_t __FNV_BASE = 14695981039346656037ULL;
 	const std::size_t __FNV_PRIME = 1099511628211ULL;
 
 	template <typename Object, typename ObjectHasher>
 	std::size_t ObjectKeyHasher<Object, ObjectHasher>::operator()(const ObjectKey<Object>& k) const
+		noexcept(noexcept(ObjectHasher{}(std::declval<const Object&>())))
 	{
 		// pack x and y into a single uint64_t integer.
 		uint64_t a = ((k.x << 29) & 0x3ffffffe0000000) | (k.y & 0x1fffffff);
@@ -396,23 +1441,27 @@ namespace Quadtree
 	}
 
 	template <typename Object, typename ObjectHasher>
-	Node<Object, ObjectHasher>::Node(bool isLeaf, uint8_t d, int x1, int y1, int x2, int y2)
-		: isLeaf(isLeaf), d(d), x1(x1), y1(y1), x2(x2), y2(y2)
+	Node<Object, ObjectHasher>::Node(bool isLeaf, uint8_t d, int x1, int y1, int x2, int y2,
+		std::pmr::memory_resource* mr)
+		: isLeaf(isLeaf), d(d), x1(x1), y1(y1), x2(x2), y2(y2), x3(x2), y3(y2), rects(mr), objects(mr), skip(this)
 	{
 		memset(children, 0, sizeof children);
 	}
 
 	template <typename Object, typename ObjectHasher>
-	Node<Object, ObjectHasher>::~Node()
+	void Node<Object, ObjectHasher>::Reset(bool isLeaf_, uint8_t d_, int x1_, int y1_, int x2_, int y2_)
 	{
-		for (int i = 0; i < 4; i++)
-		{
-			if (children[i] != nullptr)
-			{
-				delete children[i];
-				children[i] = nullptr;
-			}
-		}
+		isLeaf = isLeaf_, d = d_, x1 = x1_, y1 = y1_, x2 = x2_, y2 = y2_;
+		x3 = x2, y3 = y2;
+		memset(children, 0, sizeof children);
+		parent = nullptr;
+		skip = this;
+		n = 0, nr = 0, sx = 0, sy = 0;
+		occupancy = 0;
+		heat = 0;
+		bx1 = 0, by1 = 0, bx2 = -1, by2 = -1;
+		objects.clear();
+		rects.clear();
 	}
 
 	// Constructs a quadtree.
@@ -436,32 +1485,247 @@ namespace Quadtree
 	template <typename Object, typename ObjectHasher>
 	Quadtree<Object, ObjectHasher>::~Quadtree()
 	{
-		m.clear();
-		delete root;
+		m.Clear();
+		FreeNodes(root);
 		root = nullptr;
+		ClearPool();
 		memset(numDepthTable, 0, sizeof numDepthTable);
 		maxd = 0, numLeafNodes = 0, numObjects = 0;
 	}
 
-	// Returns the parent of given non-root node.
-	// The node passed in here should guarantee not be root.
 	template <typename Object, typename ObjectHasher>
-	Node<Object, ObjectHasher>* Quadtree<Object, ObjectHasher>::ParentOf(NodeT* node) const
+	void Quadtree<Object, ObjectHasher>::ClearPool()
 	{
-		if (node == nullptr || node == root || node->d == 0)
-			return nullptr;
-		return m.at(Pack(node->d - 1, node->x1, node->y1, w, h));
+		for (auto node : pool)
+			FreeNode(node);
+		pool.clear();
 	}
 
-	// Indicates whether given rectangle with n number of objects inside it is splitable.
-	// Return true meaning that this rectangle should be managed by a leaf node.
-	// Otherwise returns false meaning it should be managed by a non-leaf node.
+	template <typename Object, typename ObjectHasher>
+	void Quadtree<Object, ObjectHasher>::SetAllocatorPolicy(AllocatorPolicy p)
+	{
+		if (root != nullptr || !pool.empty())
+			return;
+		policy = p;
+		if (p == AllocatorPolicy::Default)
+			arena = nullptr;
+		else
+			arena = std::make_unique<HugePageArena>(sizeof(NodeT), p == AllocatorPolicy::HugeTLB);
+	}
+
+	template <typename Object, typename ObjectHasher>
+	void Quadtree<Object, ObjectHasher>::SetMemoryResource(std::pmr::memory_resource* r)
+	{
+		if (root != nullptr || !pool.empty())
+			return;
+		mr = r;
+		m.SetMemoryResource(r);
+	}
+
+	// Allocates a new node, from the arena if there's one, otherwise from the memory resource.
+	template <typename Object, typename ObjectHasher>
+	Node<Object, ObjectHasher>* Quadtree<Object, ObjectHasher>::NewNode(bool isLeaf, uint8_t d,
+		int x1, int y1, int x2, int y2)
+	{
+		static_assert(alignof(NodeT) <= alignof(std::max_align_t));
+		auto r = mr != nullptr ? mr : std::pmr::get_default_resource();
+		if (arena != nullptr)
+			return new (arena->Allocate()) NodeT(isLeaf, d, x1, y1, x2, y2, r);
+		if (mr != nullptr)
+			return new (mr->allocate(sizeof(NodeT), alignof(NodeT))) NodeT(isLeaf, d, x1, y1, x2, y2, r);
+		return new NodeT(isLeaf, d, x1, y1, x2, y2, r);
+	}
+
+	// Frees given node, its children should be already freed (or detached).
+	template <typename Object, typename ObjectHasher>
+	void Quadtree<Object, ObjectHasher>::FreeNode(NodeT* node)
+	{
+		if (arena == nullptr && mr == nullptr)
+		{
+			delete node;
+			return;
+		}
+		node->~NodeT();
+		if (arena != nullptr)
+			arena->Deallocate(node);
+		else
+			mr->deallocate(node, sizeof(NodeT), alignof(NodeT));
+	}
+
+	// Frees given node and all its descendants.
+	template <typename Object, typename ObjectHasher>
+	void Quadtree<Object, ObjectHasher>::FreeNodes(NodeT* node)
+	{
+		if (node == nullptr)
+			return;
+		for (int i = 0; i < 4; i++)
+		{
+			FreeNodes(node->children[i]);
+			node->children[i] = nullptr;
+		}
+		FreeNode(node);
+	}
+
+	template <typename Object, typename ObjectHasher>
+	void Quadtree<Object, ObjectHasher>::Reserve(int expectedNodes, int expectedObjectsPerLeaf)
+	{
+		recycle = true;
+		m.Reserve(expectedNodes);
+		pool.reserve(expectedNodes);
+		scratchCreatedLeafNodes.reserve(4);
+		scratchRemovedLeafNodes.reserve(4);
+		for (int i = m.Size() + pool.size(); i < expectedNodes; i++)
+		{
+			auto node = NewNode(true, 0, 0, 0, 0, 0);
+			node->objects.reserve(expectedObjectsPerLeaf);
+			pool.push_back(node);
+		}
+	}
+
+	template <typename Object, typename ObjectHasher>
+	Quadtree<Object, ObjectHasher>::Quadtree(Quadtree&& other) noexcept
+		: w(other.w), h(other.h)
+	{
+		MoveFrom(other);
+	}
+
+	template <typename Object, typename ObjectHasher>
+	Quadtree<Object, ObjectHasher>& Quadtree<Object, ObjectHasher>::operator=(Quadtree&& other) noexcept
+	{
+		if (this != &other)
+		{
+			m.Clear();
+			FreeNodes(root);
+			ClearPool();
+			MoveFrom(other);
+		}
+		return *this;
+	}
+
+	// Takes over all nodes and states from the other tree, which becomes an empty tree.
+	// The nodes of this tree should be already released.
+	template <typename Object, typename ObjectHasher>
+	void Quadtree<Object, ObjectHasher>::MoveFrom(Quadtree& other)
+	{
+		w = other.w, h = other.h;
+		root = other.root, other.root = nullptr;
+		m = std::move(other.m);
+		memcpy(numDepthTable, other.numDepthTable, sizeof numDepthTable);
+		memset(other.numDepthTable, 0, sizeof other.numDepthTable);
+		maxd = other.maxd, other.maxd = 0;
+		numObjects = other.numObjects, other.numObjects = 0;
+		numLeafNodes = other.numLeafNodes, other.numLeafNodes = 0;
+		numRects = other.numRects, other.numRects = 0;
+		ssf = std::move(other.ssf), ssfv2 = std::move(other.ssfv2);
+		afterLeafCreated = std::move(other.afterLeafCreated);
+		afterLeafRemoved = std::move(other.afterLeafRemoved);
+		budget = other.budget, other.budget = 0;
+		sparse = other.sparse, other.sparse = false;
+		findDescentDepth = other.findDescentDepth;
+		occupancyBitmaps = other.occupancyBitmaps, other.occupancyBitmaps = false;
+		adaptive = other.adaptive, other.adaptive = false;
+		adaptiveOptions = other.adaptiveOptions;
+		warm = std::move(other.warm);
+		other.warm.clear();
+		autoTune = other.autoTune, other.autoTune = false;
+		tuneOptions = other.tuneOptions, tuneStats = other.tuneStats;
+		pending = std::move(other.pending);
+		other.pending.clear();
+		recycle = other.recycle, other.recycle = false;
+		pool = std::move(other.pool);
+		other.pool.clear();
+		policy = other.policy, other.policy = AllocatorPolicy::Default;
+		arena = std::move(other.arena);
+		mr = other.mr, other.mr = nullptr;
+		other.m.SetMemoryResource(nullptr);
+		rebuild = std::move(other.rebuild);
+	}
+
+	template <typename Object, typename ObjectHasher>
+	Quadtree<Object, ObjectHasher> Quadtree<Object, ObjectHasher>::Clone() const
+	{
+		Quadtree dst(w, h, ssf, afterLeafCreated, afterLeafRemoved);
+		CopySettings(dst);
+		dst.budget = budget;
+		dst.warm = warm;
+		dst.pending = pending;
+		if (root == nullptr)
+			return dst;
+		dst.m.Reserve(m.Size());
+		dst.root = CloneHelper(root, nullptr, dst);
+		memcpy(dst.numDepthTable, numDepthTable, sizeof numDepthTable);
+		dst.maxd = maxd;
+		dst.numObjects = numObjects;
+		dst.numLeafNodes = numLeafNodes;
+		dst.numRects = numRects;
+		return dst;
+	}
+
+	// Copies the settings into given empty tree, except the ssf v1 and hook functions passed to the
+	// constructor, the budget and the states of the nodes.
+	template <typename Object, typename ObjectHasher>
+	void Quadtree<Object, ObjectHasher>::CopySettings(Quadtree& dst) const
+	{
+		dst.ssfv2 = ssfv2;
+		dst.sparse = sparse;
+		dst.findDescentDepth = findDescentDepth;
+		dst.occupancyBitmaps = occupancyBitmaps;
+		dst.adaptive = adaptive;
+		dst.adaptiveOptions = adaptiveOptions;
+		dst.autoTune = autoTune;
+		dst.tuneOptions = tuneOptions, dst.tuneStats = tuneStats;
+		dst.SetAllocatorPolicy(policy);
+		dst.SetMemoryResource(mr);
+	}
+
+	// Copies given node and its descendants into the dst tree, returns the copied node.
+	template <typename Object, typename ObjectHasher>
+	Node<Object, ObjectHasher>* Quadtree<Object, ObjectHasher>::CloneHelper(const NodeT* node,
+		NodeT* parent, Quadtree& dst) const
+	{
+		auto p = dst.NewNode(node->isLeaf, node->d, node->x1, node->y1, node->x2, node->y2);
+		p->parent = parent;
+		p->x3 = node->x3, p->y3 = node->y3;
+		p->n = node->n, p->nr = node->nr;
+		p->occupancy = node->occupancy;
+		p->heat = node->heat;
+		p->sx = node->sx, p->sy = node->sy;
+		p->bx1 = node->bx1, p->by1 = node->by1, p->bx2 = node->bx2, p->by2 = node->by2;
+		p->rects = node->rects;
+		p->objects = node->objects;
+		p->id = Pack(p->d, p->x1, p->y1, w, h);
+		dst.m.Insert(p);
+		for (int i = 0; i < 4; i++)
+		{
+			if (node->children[i] != nullptr)
+				p->children[i] = CloneHelper(node->children[i], p, dst);
+		}
+		p->skip = SkipOf(p);
+		return p;
+	}
+
+	// Returns the parent of given non-root node.
+	// The node passed in here should guarantee not be root.
+	template <typename Object, typename ObjectHasher>
+	Node<Object, ObjectHasher>* Quadtree<Object, ObjectHasher>::ParentOf(NodeT* node) const
+	{
+		if (node == nullptr || node == root || node->d == 0)
+			return nullptr;
+		return node->parent;
+	}
+
+	// Indicates whether given rectangle with n number of objects inside it is splitable.
+	// Return true meaning that this rectangle should be managed by a leaf node.
+	// Otherwise returns false meaning it should be managed by a non-leaf node.
 	template <typename Object, typename ObjectHasher>
 	bool Quadtree<Object, ObjectHasher>::IsSplitable(int x1, int y1, int x2, int y2, int n) const
 	{
 		// We can't split if it's a single cell.
 		if (x1 == x2 && y1 == y2)
 			return false;
+		// We can't split if there're too few objects in auto-tuning mode.
+		if (autoTune && n <= tuneStats.threshold)
+			return false;
 		// We can't split if there's a ssf function stops it.
 		// if ssfv2 is provided not nullptr, we use only ssfv2 instead of ssf v1.
 		if (ssfv2 != nullptr)
@@ -482,11 +1746,22 @@ namespace Quadtree
 		int x1, int y1, int x2,
 		int y2)
 	{
-		auto id = Pack(d, x1, y1, w, h);
-		auto node = new NodeT(isLeaf, d, x1, y1, x2, y2);
-		m.insert({ id, node });
+		auto   id = Pack(d, x1, y1, w, h);
+		NodeT* node;
+		if (!pool.empty())
+		{
+			// recycles a node from the pool.
+			node = pool.back();
+			pool.pop_back();
+			node->Reset(isLeaf, d, x1, y1, x2, y2);
+		}
+		else
+			node = NewNode(isLeaf, d, x1, y1, x2, y2);
+		node->id = id;
+		m.Insert(node);
 		if (isLeaf)
 			++numLeafNodes;
+		++churn;
 		// maintains the max depth.
 		maxd = std::max(maxd, d);
 		++numDepthTable[d];
@@ -502,7 +1777,8 @@ namespace Quadtree
 			return;
 		auto id = Pack(node->d, node->x1, node->y1, w, h);
 		// Remove from the global table.
-		m.erase(id);
+		m.Erase(id);
+		++churn;
 		// maintains the max depth.
 		--numDepthTable[node->d];
 		if (node->d == maxd)
@@ -513,8 +1789,15 @@ namespace Quadtree
 			while (numDepthTable[maxd] == 0)
 				--maxd;
 		}
-		// Finally delete this node.
-		delete node;
+		// Finally delete this node, or put it back to the pool in recycling mode.
+		if (recycle)
+		{
+			node->objects.clear();
+			node->rects.clear();
+			pool.push_back(node);
+		}
+		else
+			FreeNode(node);
 		--numLeafNodes;
 	}
 
@@ -523,11 +1806,13 @@ namespace Quadtree
 	// The (x1,y1) and (x2, y2) is the upper-left and lower-right corners of the node to create.
 	// The upstreamObjects is from the upstream node, we should filter the ones inside the
 	// rectangle (x1,y1,x2,y2) if this node is going to be a leaf node.
+	// The upstreamRects is the rectangle objects from the upstream node, we should steal the ones
+	// enclosed by the rectangle (x1,y1,x2,y2).
 	// The createdLeafNodes is to collect created leaf nodes.
 	template <typename Object, typename ObjectHasher>
 	Node<Object, ObjectHasher>* Quadtree<Object, ObjectHasher>::SplitHelper1(
 		uint8_t d, int x1, int y1, int x2, int y2, ObjectsT& upstreamObjects,
-		NodeSet& createdLeafNodes)
+		RectObjectsT& upstreamRects, NodeSet& createdLeafNodes)
 	{
 		// boundary checks.
 		if (!(x1 >= 0 && x1 < w && y1 >= 0 && y1 < h))
@@ -536,34 +1821,67 @@ namespace Quadtree
 			return nullptr;
 		if (!(x1 <= x2 && y1 <= y2))
 			return nullptr;
-		// steal objects inside this rectangle from upstream.
-		ObjectsT objs;
-		for (const auto& k : upstreamObjects)
+		// In sparse mode, empty children are not materialised.
+		if (sparse)
 		{
-			auto [x, y, o] = k;
-			if (x >= x1 && x <= x2 && y >= y1 && y <= y2)
+			bool empty = true;
+			for (auto it = upstreamObjects.begin(); empty && it != upstreamObjects.end(); ++it)
+				empty = !(it->x >= x1 && it->x <= x2 && it->y >= y1 && it->y <= y2);
+			for (std::size_t i = 0; empty && i < upstreamRects.size(); i++)
 			{
-				objs.insert(k);
+				const auto& r = upstreamRects[i];
+				empty = !(r.x1 >= x1 && r.x2 <= x2 && r.y1 >= y1 && r.y2 <= y2);
 			}
+			if (empty)
+				return nullptr;
 		}
-		// Erase from upstreamObjects.
+		// Creates the node as a leaf node first, the objects are stolen directly into its containers
+		// (which are recycled ones in recycling mode).
+		auto node = CreateNode(true, d, x1, y1, x2, y2);
+		// steal objects inside this rectangle from upstream.
 		// An object should always go to only one branch.
-		for (const auto& k : objs)
-			upstreamObjects.erase(k);
-		// Creates a leaf node if the rectangle is not able to split any more.
-		if (!IsSplitable(x1, y1, x2, y2, objs.size()))
+		for (auto it = upstreamObjects.begin(); it != upstreamObjects.end();)
+		{
+			if (it->x >= x1 && it->x <= x2 && it->y >= y1 && it->y <= y2)
+			{
+				node->objects.insert(*it);
+				it = upstreamObjects.erase(it);
+			}
+			else
+				++it;
+		}
+		// steal rectangle objects enclosed by this rectangle from upstream.
+		for (std::size_t i = 0; i < upstreamRects.size();)
+		{
+			const auto& r = upstreamRects[i];
+			if (r.x1 >= x1 && r.x2 <= x2 && r.y1 >= y1 && r.y2 <= y2)
+			{
+				node->rects.push_back(r);
+				upstreamRects[i] = upstreamRects.back();
+				upstreamRects.pop_back();
+			}
+			else
+				++i;
+		}
+		node->nr = node->rects.size();
+		UpdateStatsByScan(node);
+		--workLeft;
+		// Stays a leaf node if the rectangle is not able to split any more.
+		if (!IsSplitable(x1, y1, x2, y2, node->objects.size() + node->rects.size()))
+		{
+			createdLeafNodes.insert(node);
+			return node;
+		}
+		// Stays a leaf node for now if the work budget runs out, queued to split later.
+		if (workLeft <= 0)
 		{
-			auto node = CreateNode(true, d, x1, y1, x2, y2);
-			node->objects.swap(objs);
+			pending.push_back(node->id);
 			createdLeafNodes.insert(node);
 			return node;
 		}
-		// Creates a non-leaf node if the rectangle is able to split,
-		// and then continue to split down recursively.
-		auto node = CreateNode(false, d, x1, y1, x2, y2);
-		// Add the objects to this node temply, it will finally be stealed
-		// by the its descendant leaf nodes.
-		node->objects.swap(objs);
+		// Otherwise turns to a non-leaf node, and then continue to split down recursively.
+		// The objects added to this node temply will finally be stealed by its descendant leaf nodes,
+		// and the rectangle objects not enclosed by any child will stay at this node.
 		SplitHelper2(node, createdLeafNodes);
 		return node;
 	}
@@ -590,24 +1908,21 @@ namespace Quadtree
 		//      |  2   |  3   |
 		//      |      |      |
 		//  y2 -+------+------+-
-		int x3 = x1 + (x2 - x1) / 2, y3 = y1 + (y2 - y1) / 2;
+		int x3 = SplitMiddle(d, x1, x2, w), y3 = SplitMiddle(d, y1, y2, h);
+		node->x3 = x3, node->y3 = y3;
 
-		// determines which side each axis x3 and y3 belongs, take x axis for instance:
-		// by default, we assume x3 belongs to the left side.
-		// but if the ids of x1 and x3 are going to dismatch, which means the x3 should belong to the
-		// right side, that is we should minus x3 by 1.
-		// And minus by 1 should be enough, because x3-2 always equals to x3-4, x3-8,.. until x1.
-		// Potential optimization: how to avoid the division here?
-		uint64_t k = 1 << (d + 1);
-		if ((k * x3 / w) != (k * x1 / w))
-			--x3;
-		if ((k * y3 / h) != (k * y1 / h))
-			--y3;
+		node->children[0] = SplitHelper1(d + 1, x1, y1, x3, y3, node->objects, node->rects,
+			createdLeafNodes);
+		node->children[1] = SplitHelper1(d + 1, x3 + 1, y1, x2, y3, node->objects, node->rects,
+			createdLeafNodes);
+		node->children[2] = SplitHelper1(d + 1, x1, y3 + 1, x3, y2, node->objects, node->rects,
+			createdLeafNodes);
+		node->children[3] = SplitHelper1(d + 1, x3 + 1, y3 + 1, x2, y2, node->objects, node->rects,
+			createdLeafNodes);
 
-		node->children[0] = SplitHelper1(d + 1, x1, y1, x3, y3, node->objects, createdLeafNodes);
-		node->children[1] = SplitHelper1(d + 1, x3 + 1, y1, x2, y3, node->objects, createdLeafNodes);
-		node->children[2] = SplitHelper1(d + 1, x1, y3 + 1, x3, y2, node->objects, createdLeafNodes);
-		node->children[3] = SplitHelper1(d + 1, x3 + 1, y3 + 1, x2, y2, node->objects, createdLeafNodes);
+		for (int i = 0; i < 4; i++)
+			if (node->children[i] != nullptr)
+				node->children[i]->parent = node;
 
 		// anyway, it's not a leaf node any more.
 		if (node->isLeaf)
@@ -615,18 +1930,29 @@ namespace Quadtree
 			--numLeafNodes;
 			node->isLeaf = false;
 		}
+		node->skip = SkipOf(node);
 	}
 
-	// try to split given leaf node if possible.
+	// try to split given leaf node if possible, with a new work budget.
 	// Returns true if the spliting happens.
 	template <typename Object, typename ObjectHasher>
 	bool Quadtree<Object, ObjectHasher>::TrySplitDown(NodeT* node)
 	{
-		if (node->isLeaf && IsSplitable(node->x1, node->y1, node->x2, node->y2, node->objects.size()))
+		workLeft = budget > 0 ? budget : INT_MAX;
+		return SplitDown(node);
+	}
+
+	// try to split given leaf node if possible, within the work units left.
+	template <typename Object, typename ObjectHasher>
+	bool Quadtree<Object, ObjectHasher>::SplitDown(NodeT* node)
+	{
+		if (node->isLeaf && IsSplitable(node->x1, node->y1, node->x2, node->y2, node->n + node->nr))
 		{
 			// The createdLeafNodes is to collect created leaf nodes.
 			NodeSet createdLeafNodes;
+			createdLeafNodes.swap(scratchCreatedLeafNodes);
 			SplitHelper2(node, createdLeafNodes);
+			UpdateSkips(node->parent);
 
 			// The node itself should turn to be a non-leaf node.
 			if (afterLeafRemoved != nullptr)
@@ -637,7 +1963,8 @@ namespace Quadtree
 				for (auto createdNode : createdLeafNodes)
 					afterLeafCreated(createdNode);
 			}
-
+			createdLeafNodes.clear();
+			scratchCreatedLeafNodes.swap(createdLeafNodes);
 			return true;
 		}
 		return false;
@@ -668,20 +1995,15 @@ namespace Quadtree
 			}
 		}
 		// Count the objects inside the parent.
-		int n = 0;
-		for (int i = 0; i < 4; i++)
-		{
-			auto child = parent->children[i];
-			if (child != nullptr)
-			{
-				n += child->objects.size();
-			}
-		}
+		int n = parent->n + parent->nr;
 
 		// Check if the parent node should be a leaf node now.
 		// If it's still splitable, then it should stay be a non-leaf node.
 		if (IsSplitable(parent->x1, parent->y1, parent->x2, parent->y2, n))
 			return false;
+		// A hot parent stays split in adaptive mode.
+		if (IsHot(parent))
+			return false;
 		return true;
 	}
 
@@ -696,6 +2018,13 @@ namespace Quadtree
 		NodeT* parent;
 		if (!IsMergeable(node, parent))
 			return node;
+		// Stops here if the work budget runs out, queued to merge later.
+		if (workLeft <= 0)
+		{
+			pending.push_back(node->id);
+			return node;
+		}
+		--workLeft;
 
 		// Merges the managed objects up into the parent's objects.
 		for (int i = 0; i < 4; i++)
@@ -707,6 +2036,8 @@ namespace Quadtree
 				{
 					parent->objects.insert(k); // copy
 				}
+				for (const auto& r : child->rects)
+					parent->rects.push_back(r);
 				RemoveLeafNode(child);
 				removedLeafNodes.insert(child);
 				parent->children[i] = nullptr;
@@ -714,7 +2045,9 @@ namespace Quadtree
 		}
 		// this parent node now turns to be leaf node.
 		parent->isLeaf = true;
+		parent->skip = parent;
 		++numLeafNodes;
+		SyncOccupancy(parent);
 		// Continue the merging to the parent, until the root or some parent is splitable.
 		auto rt = MergeHelper(parent, removedLeafNodes);
 		// the parent itself is not a leaf node originally.
@@ -731,11 +2064,22 @@ namespace Quadtree
 	// Returns true if the merging happens.
 	template <typename Object, typename ObjectHasher>
 	bool Quadtree<Object, ObjectHasher>::TryMergeUp(NodeT* node)
+	{
+		workLeft = budget > 0 ? budget : INT_MAX;
+		return MergeUp(node);
+	}
+
+	// try to merge given leaf node up, within the work units left.
+	template <typename Object, typename ObjectHasher>
+	bool Quadtree<Object, ObjectHasher>::MergeUp(NodeT* node)
 	{
 		NodeSet removedLeafNodes;
-		auto	ancestor = MergeHelper(node, removedLeafNodes);
-		if (ancestor != node)
+		removedLeafNodes.swap(scratchRemovedLeafNodes);
+		auto ancestor = MergeHelper(node, removedLeafNodes);
+		bool merged = ancestor != node;
+		if (merged)
 		{
+			UpdateSkips(ancestor->parent);
 			// the node should be disapeared, merged into the ancestor
 			if (afterLeafRemoved != nullptr)
 			{
@@ -745,9 +2089,10 @@ namespace Quadtree
 			// The ancestor node is the new leaf node.
 			if (afterLeafCreated != nullptr)
 				afterLeafCreated(ancestor);
-			return true;
 		}
-		return false;
+		removedLeafNodes.clear();
+		scratchRemovedLeafNodes.swap(removedLeafNodes);
+		return merged;
 	}
 
 	// AABB overlap testing.
@@ -790,6 +2135,22 @@ namespace Quadtree
 		return ax1 <= bx2 && ax2 >= bx1 && ay1 <= by2 && ay2 >= by1;
 	}
 
+	// Returns the mask of the cells inside the range [(x1,y1),(x2,y2)] in the occupancy bitmap of a
+	// leaf node [(nx1,ny1),(nx2,ny2)] with at most 8x8 cells.
+	inline uint64_t OccupancyMask(int nx1, int ny1, int nx2, int ny2, int x1, int y1, int x2, int y2)
+	{
+		x1 = std::max(x1, nx1) - nx1, x2 = std::min(x2, nx2) - nx1;
+		y1 = std::max(y1, ny1) - ny1, y2 = std::min(y2, ny2) - ny1;
+		if (x1 > x2 || y1 > y2)
+			return 0;
+		// the columns [x1,x2] of a row, repeated on the rows [y1,y2].
+		uint64_t row = ((1ULL << (x2 - x1 + 1)) - 1) << x1;
+		uint64_t mask = 0;
+		for (int y = y1; y <= y2; y++)
+			mask |= row << (y * 8);
+		return mask;
+	}
+
 	// Query objects or leaf nodes located in given rectangle in the given node.
 	// the objectsCollector and nodeVisitor is optional
 	template <typename Object, typename ObjectHasher>
@@ -799,12 +2160,23 @@ namespace Quadtree
 	{
 		if (node == nullptr)
 			return;
+		// Collecting only objects, jumps along the compressed edge.
+		if (nodeVisitor == nullptr)
+			node = node->skip;
 		// AABB overlap test.
 		if (!isOverlap(node->x1, node->y1, node->x2, node->y2, x1, y1, x2, y2))
 			return;
 
 		if (!node->isLeaf)
 		{
+			// A split node overlapped partially keeps warm in adaptive mode.
+			if (adaptive && node->heat > 0
+				&& !(x1 <= node->x1 && node->x2 <= x2 && y1 <= node->y1 && node->y2 <= y2))
+				Heat(node);
+			// prefetches the children, so their cache misses overlap instead of one after another.
+			for (int i = 0; i < 4; i++)
+				if (node->children[i] != nullptr)
+					Prefetch(node->children[i]);
 			// recursively down to the children.
 			for (int i = 0; i < 4; i++)
 			{
@@ -816,17 +2188,37 @@ namespace Quadtree
 		if (nodeVisitor != nullptr)
 			nodeVisitor(node);
 		// Visit objects if provided.
+		// Skips the scan if no cell inside the range is occupied.
+		if (objectsCollector != nullptr && HasOccupancy(node)
+			&& !(node->occupancy & OccupancyMask(node->x1, node->y1, node->x2, node->y2, x1, y1, x2, y2)))
+			return;
 		if (objectsCollector != nullptr)
 		{
 			// Collects objects inside the rectangle for this leaf node.
+			int hits = 0;
 			for (auto [x, y, o] : node->objects)
 				if (x >= x1 && x <= x2 && y >= y1 && y <= y2)
 				{
 					objectsCollector(x, y, o);
+					++hits;
 				}
+			// A scan mostly wasted heats the leaf node in adaptive mode.
+			int n = node->objects.size();
+			if (autoTune)
+				tuneStats.scanned += n, tuneStats.wasted += n - hits;
+			if (adaptive && n >= adaptiveOptions.minObjects && n - hits >= adaptiveOptions.wasteRatio * n)
+				Heat(node);
 		}
 	}
 
+	template <typename Object, typename ObjectHasher>
+	Node<Object, ObjectHasher>* Quadtree<Object, ObjectHasher>::Find(int x, int y) const
+	{
+		if (maxd <= findDescentDepth)
+			return FindByDescent(x, y);
+		return FindByDepthSearch(x, y);
+	}
+
 	// Using binary search to guess the depth of the target node.
 	// Reason: the id = (d, x*2^d/w, y*2^d/h), it's the same for all (x,y) inside the same
 	// node. If id(d,x,y) is not found in the map m, the guessed depth is too large, we should
@@ -835,38 +2227,90 @@ namespace Quadtree
 	// it's the correct answer. The time complexity is O(log maxd), where maxd is the depth of
 	// this whole tree.
 	template <typename Object, typename ObjectHasher>
-	Node<Object, ObjectHasher>* Quadtree<Object, ObjectHasher>::Find(int x, int y) const
+	Node<Object, ObjectHasher>* Quadtree<Object, ObjectHasher>::FindByDepthSearch(int x, int y) const
 	{
+		if (!(x >= 0 && x < w && y >= 0 && y < h))
+			return nullptr;
 		int l = 0, r = maxd;
+		// the position scaled at the max depth, the ids at all depths derive from it.
+		uint64_t qx = (uint64_t(x) << maxd) / w, qy = (uint64_t(y) << maxd) / h;
+		// The target of root's compressed edge exists, starts from its depth if it contains (x,y).
+		if (root != nullptr)
+		{
+			auto s = root->skip;
+			if (x >= s->x1 && x <= s->x2 && y >= s->y1 && y <= s->y2)
+				l = s->d;
+		}
 		while (l <= r)
 		{
 			// note: use int instead of uint8_t
 			int	 d = (l + r) >> 1;
-			auto id = Pack(d, x, y, w, h);
-			auto it = m.find(id);
-			if (it == m.end())
+			auto id = PackScaled(d, qx, qy, maxd);
+			// Speculative probes for both possible next depths, their cache misses overlap with the
+			// probe at current depth.
+			if (l < d)
+				m.Prefetch(PackScaled((l + d - 1) >> 1, qx, qy, maxd));
+			if (d < r)
+				m.Prefetch(PackScaled((d + 1 + r) >> 1, qx, qy, maxd));
+			auto node = m.Find(id);
+			if (node == nullptr)
 			{ // too large
 				r = d - 1;
 			}
 			else
 			{
-				auto node = it->second;
 				if (node->isLeaf)
 					return node;
 				l = d + 1; // too small
+				// Restarts from the target of its compressed edge if it contains (x,y), the search
+				// cost scales with the number of branching nodes on the path, instead of the depth.
+				auto s = node->skip;
+				if (x >= s->x1 && x <= s->x2 && y >= s->y1 && y <= s->y2)
+				{
+					if (s->isLeaf)
+						return s;
+					l = std::max(l, s->d + 1);
+				}
 			}
 		}
 		return nullptr;
 	}
 
+	template <typename Object, typename ObjectHasher>
+	Node<Object, ObjectHasher>* Quadtree<Object, ObjectHasher>::FindByDescent(int x, int y) const
+	{
+		if (root == nullptr)
+			return nullptr;
+		if (!(x >= 0 && x < w && y >= 0 && y < h))
+			return nullptr;
+		auto node = root;
+		while (node != nullptr && !node->isLeaf)
+		{
+			// Jumps along the compressed edge if its target contains (x,y).
+			auto s = node->skip;
+			if (s != node && x >= s->x1 && x <= s->x2 && y >= s->y1 && y <= s->y2)
+				node = s;
+			else
+				node = node->children[(x > node->x3) + 2 * (y > node->y3)];
+		}
+		// nullptr for an implicit empty leaf node in sparse mode.
+		return node;
+	}
+
 	template <typename Object, typename ObjectHasher>
 	void Quadtree<Object, ObjectHasher>::Add(int x, int y, Object o)
 	{
+		if (rebuild != nullptr)
+			rebuild->log.push_back([=](Quadtree& t) { t.Add(x, y, o); });
 		// boundary checks.
 		if (!(x >= 0 && x < w && y >= 0 && y < h))
 			return;
 		// find the leaf node.
 		auto node = Find(x, y);
+		auto churned = churn;
+		// In sparse mode, creates the leaf node if it's absent.
+		if (node == nullptr && sparse && root != nullptr)
+			node = Materialize(FindSmallestNodeCoveringRange(x, y, x, y), x, y, x, y);
 		if (node == nullptr)
 			return;
 		// add the object to this leaf node.
@@ -874,14 +2318,21 @@ namespace Quadtree
 		if (inserted)
 		{
 			++numObjects;
+			if (HasOccupancy(node))
+				node->occupancy |= 1ULL << ((y - node->y1) * 8 + (x - node->x1));
+			PropagateAdd(node, 1, x, y, x, y, x, y);
 			// At most only one of "split and merge" will be performed.
 			TrySplitDown(node) || TryMergeUp(node);
 		}
+		if (autoTune)
+			tuneStats.updates += inserted, tuneStats.restructures += churn - churned;
 	}
 
 	template <typename Object, typename ObjectHasher>
 	void Quadtree<Object, ObjectHasher>::Remove(int x, int y, Object o)
 	{
+		if (rebuild != nullptr)
+			rebuild->log.push_back([=](Quadtree& t) { t.Remove(x, y, o); });
 		// boundary checks.
 		if (!(x >= 0 && x < w && y >= 0 && y < h))
 			return;
@@ -893,14 +2344,25 @@ namespace Quadtree
 		if (node->objects.erase({ x, y, o }) > 0)
 		{
 			--numObjects;
+			auto churned = churn;
+			// the cell may be still occupied by other objects.
+			if (HasOccupancy(node))
+				SyncOccupancy(node);
+			PropagateRemove(node, x, y, 1);
 			// At most only one of "split and merge" will be performed.
 			TryMergeUp(node) || TrySplitDown(node);
+			if (sparse)
+				TryPrune(x, y, x, y);
+			if (autoTune)
+				++tuneStats.updates, tuneStats.restructures += churn - churned;
 		}
 	}
 
 	template <typename Object, typename ObjectHasher>
 	void Quadtree<Object, ObjectHasher>::RemoveObjects(int x, int y)
 	{
+		if (rebuild != nullptr)
+			rebuild->log.push_back([=](Quadtree& t) { t.RemoveObjects(x, y); });
 		// boundary checks.
 		if (!(x >= 0 && x < w && y >= 0 && y < h))
 			return;
@@ -910,11 +2372,18 @@ namespace Quadtree
 			return;
 		int size = node->objects.size();
 		node->objects.clear();
+		node->occupancy = 0;
 		if (size)
 		{
 			numObjects -= size;
+			auto churned = churn;
+			PropagateRemove(node, x, y, size);
 			// At most only one of "split and merge" will be performed.
 			TryMergeUp(node) || TrySplitDown(node);
+			if (sparse)
+				TryPrune(x, y, x, y);
+			if (autoTune)
+				++tuneStats.updates, tuneStats.restructures += churn - churned;
 		}
 	}
 
@@ -930,11 +2399,26 @@ namespace Quadtree
 		}
 	}
 
+	template <typename Object, typename ObjectHasher>
+	int Quadtree<Object, ObjectHasher>::Step(int b)
+	{
+		workLeft = b;
+		while (workLeft > 0 && !pending.empty())
+		{
+			auto node = m.Find(pending.front());
+			pending.pop_front();
+			// the node may be already removed, or restructured.
+			if (node == nullptr || !node->isLeaf)
+				continue;
+			SplitDown(node) || MergeUp(node);
+		}
+		return pending.size();
+	}
+
 	template <typename Object, typename ObjectHasher>
 	void Quadtree<Object, ObjectHasher>::ForEachNode(VisitorT& visitor) const
 	{
-		for (auto [id, node] : m)
-			visitor(node);
+		m.ForEach(visitor);
 	}
 
 	// Using binary search to guess the smallest node that contains the given rectangle range.
@@ -953,6 +2437,15 @@ namespace Quadtree
 		// Find the target
 		int	   l = 0, r = dma;
 		NodeT* node = root;
+		// Starts from the target of root's compressed edge if it covers the range.
+		if (root != nullptr)
+		{
+			auto s = root->skip;
+			// the two corners are not required to be ordered.
+			if (s->d <= dma && std::min(x1, x2) >= s->x1 && std::max(x1, x2) <= s->x2
+				&& std::min(y1, y2) >= s->y1 && std::max(y1, y2) <= s->y2)
+				l = s->d, node = s;
+		}
 		while (l < r)
 		{
 			// note: use int instead of uint8_t
@@ -963,11 +2456,16 @@ namespace Quadtree
 			// id1==id2 and the node at this id exists.
 			if (id1 == id2)
 			{
-				auto it = m.find(id1);
-				if (it != m.end())
+				auto p = m.Find(id1);
+				if (p != nullptr)
 				{
 					l = d;
-					node = it->second;
+					node = p;
+					// Restarts from the target of its compressed edge if it covers the range.
+					auto s = p->skip;
+					if (s->d <= dma && std::min(x1, x2) >= s->x1 && std::max(x1, x2) <= s->x2
+						&& std::min(y1, y2) >= s->y1 && std::max(y1, y2) <= s->y2)
+						l = s->d, node = s;
 					continue;
 				}
 			}
@@ -998,6 +2496,8 @@ namespace Quadtree
 		auto node = FindSmallestNodeCoveringRange(x1, y1, x2, y2);
 		if (node == nullptr)
 			node = root;
+		if (autoTune)
+			++tuneStats.queries;
 		VisitorT nodeVisitor = nullptr;
 		QueryRange(node, collector, nodeVisitor, x1, y1, x2, y2);
 	}
@@ -1210,6 +2710,9 @@ namespace Quadtree
 
 		// the children to go down, (at most 2)
 		const auto& t = GET_LEAF_NODES_AT_DIRECTION_JUMP_TABLE[flag][direction];
+		// prefetches the second one while going down the first one.
+		if (t[1] != -1)
+			Prefetch(node->children[t[1]]);
 		if (t[0] != -1)
 			GetLeafNodesAtDirection(node->children[t[0]], direction, visitor);
 		if (t[1] != -1)
@@ -1232,7 +2735,7 @@ namespace Quadtree
 			return;
 		// Is it still exist?
 		auto id = Pack(leafNode->d, leafNode->x1, leafNode->y1, w, h);
-		if (m.find(id) == m.end())
+		if (m.Find(id) == nullptr)
 			return;
 		// only one will happen.
 		TryMergeUp(leafNode) || TrySplitDown(leafNode);
@@ -1244,24 +2747,2048 @@ namespace Quadtree
 	{
 		if (leafNode == nullptr || !leafNode->isLeaf)
 			return;
+		// the leaf node may not exist in the fresh tree, adds the items inside it one by one.
+		if (rebuild != nullptr)
+			rebuild->log.push_back([=, x1 = leafNode->x1, y1 = leafNode->y1, x2 = leafNode->x2,
+									   y2 = leafNode->y2](Quadtree& t) {
+				for (const auto& [x, y, o] : items)
+					if (x >= x1 && x <= x2 && y >= y1 && y <= y2)
+						t.Add(x, y, o);
+			});
 
-		int numAdded = 0;
+		int		numAdded = 0;
+		int64_t sx = 0, sy = 0;
+		int		bx1 = w, by1 = h, bx2 = -1, by2 = -1;
 
 		for (const auto& [x, y, o] : items)
 		{
 			if (!(x >= leafNode->x1 && x <= leafNode->x2 && y >= leafNode->y1 && y <= leafNode->y2))
 				continue;
-			leafNode->objects.insert({ x, y, o });
-			++numAdded;
-			++numObjects;
+			if (leafNode->objects.insert({ x, y, o }).second)
+			{
+				if (HasOccupancy(leafNode))
+					leafNode->occupancy |= 1ULL << ((y - leafNode->y1) * 8 + (x - leafNode->x1));
+				++numAdded;
+				++numObjects;
+				sx += x, sy += y;
+				bx1 = std::min(bx1, x), by1 = std::min(by1, y);
+				bx2 = std::max(bx2, x), by2 = std::max(by2, y);
+			}
 		}
 
 		if (numAdded)
 		{
+			PropagateAdd(leafNode, numAdded, sx, sy, bx1, by1, bx2, by2);
 			TrySplitDown(leafNode) || TryMergeUp(leafNode);
 		}
 	}
 
+	// Recalculates the counter and clustering informations of given node from its objects container.
+	template <typename Object, typename ObjectHasher>
+	void Quadtree<Object, ObjectHasher>::UpdateStatsByScan(NodeT* node) const
+	{
+		node->n = node->objects.size();
+		node->sx = 0, node->sy = 0;
+		for (const auto& k : node->objects)
+			node->sx += k.x, node->sy += k.y;
+		UpdateBoundingBox(node);
+		node->skip = SkipOf(node);
+		SyncOccupancy(node);
+	}
+
+	// Recalculates the bounding box of given node, from its objects for a leaf node, or from its
+	// children for a non-leaf node.
+	// Returns true if the bounding box changes.
+	template <typename Object, typename ObjectHasher>
+	bool Quadtree<Object, ObjectHasher>::UpdateBoundingBox(NodeT* node) const
+	{
+		int bx1 = w, by1 = h, bx2 = -1, by2 = -1;
+		if (node->isLeaf || !node->objects.empty())
+		{
+			for (const auto& k : node->objects)
+			{
+				bx1 = std::min(bx1, k.x), by1 = std::min(by1, k.y);
+				bx2 = std::max(bx2, k.x), by2 = std::max(by2, k.y);
+			}
+		}
+		else
+		{
+			for (int i = 0; i < 4; i++)
+			{
+				auto child = node->children[i];
+				if (child == nullptr || child->n == 0)
+					continue;
+				bx1 = std::min(bx1, child->bx1), by1 = std::min(by1, child->by1);
+				bx2 = std::max(bx2, child->bx2), by2 = std::max(by2, child->by2);
+			}
+		}
+		bool changed = bx1 != node->bx1 || by1 != node->by1 || bx2 != node->bx2 || by2 != node->by2;
+		node->bx1 = bx1, node->by1 = by1, node->bx2 = bx2, node->by2 = by2;
+		return changed;
+	}
+
+	// Recalculates the counter and clustering informations of given non-leaf node from its children.
+	template <typename Object, typename ObjectHasher>
+	void Quadtree<Object, ObjectHasher>::UpdateStatsByChildren(NodeT* node) const
+	{
+		node->n = 0, node->sx = 0, node->sy = 0;
+		for (int i = 0; i < 4; i++)
+		{
+			auto child = node->children[i];
+			if (child != nullptr)
+				node->n += child->n, node->sx += child->sx, node->sy += child->sy;
+		}
+		UpdateBoundingBox(node);
+		node->skip = SkipOf(node);
+	}
+
+	// Adds n objects to the counters and clustering informations of given node and all its ancestors.
+	// The (sx,sy) is the sum of the added objects' positions, and (bx1,by1),(bx2,by2) is their
+	// bounding box.
+	template <typename Object, typename ObjectHasher>
+	void Quadtree<Object, ObjectHasher>::PropagateAdd(NodeT* node, int n, int64_t sx, int64_t sy,
+		int bx1, int by1, int bx2, int by2)
+	{
+		for (; node != nullptr; node = node->parent)
+		{
+			if (node->n == 0)
+			{
+				node->bx1 = bx1, node->by1 = by1, node->bx2 = bx2, node->by2 = by2;
+			}
+			else
+			{
+				node->bx1 = std::min(node->bx1, bx1), node->by1 = std::min(node->by1, by1);
+				node->bx2 = std::max(node->bx2, bx2), node->by2 = std::max(node->by2, by2);
+			}
+			node->n += n, node->sx += sx, node->sy += sy;
+			node->skip = SkipOf(node);
+		}
+	}
+
+	// Removes n objects located at position (x,y) from the counters and clustering informations of
+	// given node and all its ancestors.
+	// The bounding boxes are recalculated only if (x,y) is on the boundary, and stop to propagate
+	// once a bounding box stays unchanged.
+	template <typename Object, typename ObjectHasher>
+	void Quadtree<Object, ObjectHasher>::PropagateRemove(NodeT* node, int x, int y, int n)
+	{
+		bool dirty = x == node->bx1 || x == node->bx2 || y == node->by1 || y == node->by2;
+		for (; node != nullptr; node = node->parent)
+		{
+			node->n -= n, node->sx -= int64_t(x) * n, node->sy -= int64_t(y) * n;
+			if (dirty)
+				dirty = UpdateBoundingBox(node);
+			node->skip = SkipOf(node);
+		}
+	}
+
+	// Returns the compressed edge's target of given node, the children's should be up-to-date.
+	template <typename Object, typename ObjectHasher>
+	Node<Object, ObjectHasher>* Quadtree<Object, ObjectHasher>::SkipOf(NodeT* node) const
+	{
+		if (node->isLeaf || node->n == 0)
+			return node;
+		NodeT* only = nullptr;
+		for (int i = 0; i < 4; i++)
+		{
+			auto child = node->children[i];
+			if (child != nullptr && child->n > 0)
+			{
+				if (only != nullptr)
+					return node;
+				only = child;
+			}
+		}
+		// a node under spliting may hold the objects itself temply.
+		return only == nullptr ? node : only->skip;
+	}
+
+	// Updates the compressed edges of given node and all its ancestors.
+	template <typename Object, typename ObjectHasher>
+	void Quadtree<Object, ObjectHasher>::UpdateSkips(NodeT* node) const
+	{
+		for (; node != nullptr; node = node->parent)
+			node->skip = SkipOf(node);
+	}
+
+	// Collects the non-empty nodes fully covered by given rectangle into fullNodes, and the objects
+	// inside the rectangle from the partially covered leaf nodes into edgeObjects.
+	template <typename Object, typename ObjectHasher>
+	void Quadtree<Object, ObjectHasher>::CollectRangeCover(NodeT* node, int x1, int y1, int x2, int y2,
+		std::vector<NodeT*>& fullNodes, std::vector<ObjectKey<Object>>& edgeObjects) const
+	{
+		if (node == nullptr || node->n == 0)
+			return;
+		if (!isOverlap(node->x1, node->y1, node->x2, node->y2, x1, y1, x2, y2))
+			return;
+		// Fully covered.
+		if (node->x1 >= x1 && node->x2 <= x2 && node->y1 >= y1 && node->y2 <= y2)
+		{
+			fullNodes.push_back(node);
+			return;
+		}
+		if (node->isLeaf)
+		{
+			for (const auto& k : node->objects)
+				if (k.x >= x1 && k.x <= x2 && k.y >= y1 && k.y <= y2)
+					edgeObjects.push_back(k);
+			return;
+		}
+		for (int i = 0; i < 4; i++)
+			CollectRangeCover(node->children[i], x1, y1, x2, y2, fullNodes, edgeObjects);
+	}
+
+	template <typename Object, typename ObjectHasher>
+	template <typename RNG>
+	void Quadtree<Object, ObjectHasher>::SampleRange(int x1, int y1, int x2, int y2, int k, RNG& rng,
+		CollectorT& collector) const
+	{
+		if (!(x1 <= x2 && y1 <= y2) || k <= 0 || root == nullptr)
+			return;
+
+		x1 = std::max(x1, 0), y1 = std::max(y1, 0);
+		x2 = std::min(x2, w - 1), y2 = std::min(y2, h - 1);
+
+		auto node = FindSmallestNodeCoveringRange(x1, y1, x2, y2);
+		if (node == nullptr)
+			node = root;
+
+		std::vector<NodeT*>			   fullNodes;
+		std::vector<ObjectKey<Object>> edgeObjects;
+		CollectRangeCover(node, x1, y1, x2, y2, fullNodes, edgeObjects);
+
+		// prefix[i] is the total number of objects inside fullNodes[0..i].
+		std::vector<int> prefix(fullNodes.size());
+		int				 numFull = 0;
+		for (std::size_t i = 0; i < fullNodes.size(); i++)
+			prefix[i] = (numFull += fullNodes[i]->n);
+
+		int total = numFull + edgeObjects.size();
+		if (total == 0)
+			return;
+
+		std::uniform_int_distribution<int> dist(0, total - 1);
+		for (int i = 0; i < k; i++)
+		{
+			// r is the rank of the object to pick.
+			int r = dist(rng);
+			if (r >= numFull)
+			{
+				const auto& e = edgeObjects[r - numFull];
+				collector(e.x, e.y, e.o);
+				continue;
+			}
+			// Locate the fully covered node containing the r-th object.
+			auto j = std::upper_bound(prefix.begin(), prefix.end(), r) - prefix.begin();
+			if (j > 0)
+				r -= prefix[j - 1];
+			// Descend proportionally to the children's counters.
+			NodeT* p = fullNodes[j];
+			while (!p->isLeaf)
+			{
+				for (int c = 0; c < 4; c++)
+				{
+					auto child = p->children[c];
+					if (child == nullptr)
+						continue;
+					if (r < child->n)
+					{
+						p = child;
+						break;
+					}
+					r -= child->n;
+				}
+			}
+			auto it = p->objects.begin();
+			std::advance(it, r);
+			collector(it->x, it->y, it->o);
+		}
+	}
+
+	template <typename Object, typename ObjectHasher>
+	template <typename RNG>
+	void Quadtree<Object, ObjectHasher>::SampleRange(int x1, int y1, int x2, int y2, int k, RNG& rng,
+		CollectorT&& collector) const
+	{
+		SampleRange(x1, y1, x2, y2, k, rng, collector);
+	}
+
+	// ~~~~~~~~~~~ Internals::Bulk Restructuring ~~~~~~~~~~~~~
+	// The bulk operations modify many leaf nodes at once, and then merge or split the affected nodes
+	// in a single bottom-up pass. During a round, the createdLeafNodes and removedLeafNodes collect
+	// the leaf nodes to report to the hook functions. A leaf node both created and removed in the same
+	// round is reported to neither of them.
+
+	// Removes given node and all its descendants, the objects inside them are dropped.
+	template <typename Object, typename ObjectHasher>
+	void Quadtree<Object, ObjectHasher>::RemoveSubtree(NodeT* node, NodeSet& createdLeafNodes,
+		NodeSet& removedLeafNodes)
+	{
+		for (int i = 0; i < 4; i++)
+		{
+			if (node->children[i] != nullptr)
+			{
+				RemoveSubtree(node->children[i], createdLeafNodes, removedLeafNodes);
+				node->children[i] = nullptr;
+			}
+		}
+		if (node->isLeaf)
+		{
+			if (createdLeafNodes.erase(node) == 0)
+				removedLeafNodes.insert(node);
+		}
+		else
+		{
+			// A childless non-leaf node is removed the same way as a leaf node.
+			node->isLeaf = true;
+			++numLeafNodes;
+		}
+		RemoveLeafNode(node);
+	}
+
+	// Merges the leaf children of given node into itself, the node turns into a leaf node.
+	template <typename Object, typename ObjectHasher>
+	void Quadtree<Object, ObjectHasher>::MergeChildren(NodeT* node, NodeSet& createdLeafNodes,
+		NodeSet& removedLeafNodes)
+	{
+		for (int i = 0; i < 4; i++)
+		{
+			auto child = node->children[i];
+			if (child == nullptr)
+				continue;
+			for (const auto& k : child->objects)
+				node->objects.insert(k);
+			for (const auto& r : child->rects)
+				node->rects.push_back(r);
+			node->children[i] = nullptr;
+			if (createdLeafNodes.erase(child) == 0)
+				removedLeafNodes.insert(child);
+			RemoveLeafNode(child);
+		}
+		node->isLeaf = true;
+		node->skip = node;
+		++numLeafNodes;
+		createdLeafNodes.insert(node);
+		SyncOccupancy(node);
+	}
+
+	// Restructures given node whose objects have changed, assuming its descendants are already
+	// restructured:
+	// 1. a leaf node splits down if it's splitable now.
+	// 2. a non-leaf node merges its children if they are all leaf nodes and it's not splitable now.
+	template <typename Object, typename ObjectHasher>
+	void Quadtree<Object, ObjectHasher>::Restructure(NodeT* node, NodeSet& createdLeafNodes,
+		NodeSet& removedLeafNodes)
+	{
+		if (node->isLeaf)
+		{
+			if (IsSplitable(node->x1, node->y1, node->x2, node->y2, node->n + node->nr))
+			{
+				if (createdLeafNodes.erase(node) == 0)
+					removedLeafNodes.insert(node);
+				SplitHelper2(node, createdLeafNodes);
+			}
+			return;
+		}
+		for (int i = 0; i < 4; i++)
+		{
+			auto child = node->children[i];
+			if (child != nullptr && !child->isLeaf)
+				return;
+		}
+		if (!IsSplitable(node->x1, node->y1, node->x2, node->y2, node->n + node->nr) && !IsHot(node))
+			MergeChildren(node, createdLeafNodes, removedLeafNodes);
+	}
+
+	// Calls the hook functions at the end of a bulk restructuring round.
+	template <typename Object, typename ObjectHasher>
+	void Quadtree<Object, ObjectHasher>::AfterRestructure(NodeSet& createdLeafNodes,
+		NodeSet& removedLeafNodes)
+	{
+		if (afterLeafRemoved != nullptr)
+		{
+			for (auto node : removedLeafNodes)
+				afterLeafRemoved(node);
+		}
+		if (afterLeafCreated != nullptr)
+		{
+			for (auto node : createdLeafNodes)
+				afterLeafCreated(node);
+		}
+	}
+
+	template <typename Object, typename ObjectHasher>
+	void Quadtree<Object, ObjectHasher>::RemoveRange(int x1, int y1, int x2, int y2)
+	{
+		PredicateT pred = nullptr;
+		RemoveIfInRange(x1, y1, x2, y2, pred);
+	}
+
+	template <typename Object, typename ObjectHasher>
+	void Quadtree<Object, ObjectHasher>::RemoveIf(PredicateT& pred)
+	{
+		RemoveIfInRange(0, 0, w - 1, h - 1, pred);
+	}
+
+	template <typename Object, typename ObjectHasher>
+	void Quadtree<Object, ObjectHasher>::RemoveIf(PredicateT&& pred)
+	{
+		RemoveIf(pred);
+	}
+
+	template <typename Object, typename ObjectHasher>
+	void Quadtree<Object, ObjectHasher>::RemoveIfInRange(int x1, int y1, int x2, int y2,
+		PredicateT& pred)
+	{
+		// The predicate may be stateful, the objects it removes are logged instead of itself.
+		PredicateT logged = nullptr;
+		if (rebuild != nullptr && pred == nullptr)
+			rebuild->log.push_back([=](Quadtree& t) { t.RemoveRange(x1, y1, x2, y2); });
+		else if (rebuild != nullptr)
+		{
+			logged = [this, &pred](int x, int y, Object o) {
+				if (!pred(x, y, o))
+					return false;
+				rebuild->log.push_back([=](Quadtree& t) { t.Remove(x, y, o); });
+				return true;
+			};
+		}
+		auto& p = logged != nullptr ? logged : pred;
+		if (!(x1 <= x2 && y1 <= y2) || root == nullptr)
+			return;
+
+		x1 = std::max(x1, 0), y1 = std::max(y1, 0);
+		x2 = std::min(x2, w - 1), y2 = std::min(y2, h - 1);
+
+		NodeSet createdLeafNodes, removedLeafNodes;
+		createdLeafNodes.swap(scratchCreatedLeafNodes);
+		removedLeafNodes.swap(scratchRemovedLeafNodes);
+		workLeft = budget > 0 ? budget : INT_MAX;
+		if (RemoveRangeHelper(root, x1, y1, x2, y2, p, createdLeafNodes, removedLeafNodes) > 0)
+			AfterRestructure(createdLeafNodes, removedLeafNodes);
+		createdLeafNodes.clear(), removedLeafNodes.clear();
+		scratchCreatedLeafNodes.swap(createdLeafNodes);
+		scratchRemovedLeafNodes.swap(removedLeafNodes);
+	}
+
+	template <typename Object, typename ObjectHasher>
+	void Quadtree<Object, ObjectHasher>::RemoveIfInRange(int x1, int y1, int x2, int y2,
+		PredicateT&& pred)
+	{
+		RemoveIfInRange(x1, y1, x2, y2, pred);
+	}
+
+	// Removes the objects inside given rectangle satisfying given predicate from the subtree of given
+	// node, and restructures the affected nodes bottom-up.
+	// A nullptr pred means to remove all objects inside the rectangle.
+	// Returns the number of objects removed.
+	template <typename Object, typename ObjectHasher>
+	int Quadtree<Object, ObjectHasher>::RemoveRangeHelper(NodeT* node, int x1, int y1, int x2, int y2,
+		PredicateT& pred, NodeSet& createdLeafNodes, NodeSet& removedLeafNodes)
+	{
+		if (node == nullptr || node->n == 0)
+			return 0;
+		if (!isOverlap(node->x1, node->y1, node->x2, node->y2, x1, y1, x2, y2))
+			return 0;
+
+		int removed = 0;
+		if (pred == nullptr && node->x1 >= x1 && node->x2 <= x2 && node->y1 >= y1 && node->y2 <= y2)
+		{
+			// Fully covered: collapse into an empty leaf node.
+			// The rectangle objects are kept, they move up to this node.
+			removed = node->n;
+			if (!node->isLeaf)
+			{
+				for (int i = 0; i < 4; i++)
+				{
+					if (node->children[i] != nullptr)
+					{
+						CollectRects(node->children[i], node->rects);
+						RemoveSubtree(node->children[i], createdLeafNodes, removedLeafNodes);
+						node->children[i] = nullptr;
+					}
+				}
+				node->isLeaf = true;
+				++numLeafNodes;
+				createdLeafNodes.insert(node);
+			}
+			node->objects.clear();
+			numObjects -= removed;
+		}
+		else if (node->isLeaf)
+		{
+			for (auto it = node->objects.begin(); it != node->objects.end();)
+			{
+				if (it->x >= x1 && it->x <= x2 && it->y >= y1 && it->y <= y2
+					&& (pred == nullptr || pred(it->x, it->y, it->o)))
+				{
+					it = node->objects.erase(it);
+					++removed;
+				}
+				else
+					++it;
+			}
+			numObjects -= removed;
+		}
+		else
+		{
+			for (int i = 0; i < 4; i++)
+			{
+				auto child = node->children[i];
+				removed += RemoveRangeHelper(child, x1, y1, x2, y2, pred, createdLeafNodes,
+					removedLeafNodes);
+				// In sparse mode, removes the children turning into empty leaf nodes.
+				if (sparse && child != nullptr && child->isLeaf && child->n + child->nr == 0)
+				{
+					node->children[i] = nullptr;
+					if (createdLeafNodes.erase(child) == 0)
+						removedLeafNodes.insert(child);
+					RemoveLeafNode(child);
+				}
+			}
+		}
+
+		if (removed == 0)
+			return 0;
+		if (node->isLeaf)
+			UpdateStatsByScan(node);
+		else
+			UpdateStatsByChildren(node);
+		Restructure(node, createdLeafNodes, removedLeafNodes);
+		return removed;
+	}
+
+	// ~~~~~~~~~~~ Sparse Mode ~~~~~~~~~~~~~
+
+	// Given the smallest node enclosing the range [(x1,y1),(x2,y2)], creates the absent child of it
+	// enclosing the range as a new leaf node, and returns it.
+	// Returns the given node itself if it's a leaf node or no child slot encloses the range.
+	template <typename Object, typename ObjectHasher>
+	Node<Object, ObjectHasher>* Quadtree<Object, ObjectHasher>::Materialize(NodeT* node, int x1,
+		int y1, int x2, int y2)
+	{
+		if (node == nullptr || node->isLeaf)
+			return node;
+		// The same spliting to SplitHelper2.
+		int x3 = SplitMiddle(node->d, node->x1, node->x2, w);
+		int y3 = SplitMiddle(node->d, node->y1, node->y2, h);
+		if ((x1 <= x3) != (x2 <= x3) || (y1 <= y3) != (y2 <= y3))
+			return node;
+		int i = (x1 > x3) | ((y1 > y3) << 1);
+		if (node->children[i] != nullptr)
+			return node;
+		int	 cx1 = (i & 1) ? x3 + 1 : node->x1, cx2 = (i & 1) ? node->x2 : x3;
+		int	 cy1 = (i & 2) ? y3 + 1 : node->y1, cy2 = (i & 2) ? node->y2 : y3;
+		auto child = CreateNode(true, node->d + 1, cx1, cy1, cx2, cy2);
+		child->parent = node;
+		node->children[i] = child;
+		if (afterLeafCreated != nullptr)
+			afterLeafCreated(child);
+		return child;
+	}
+
+	// Removes given empty leaf node from its parent, and continues on the parent if it turns into an
+	// empty leaf node. A non-leaf node without children turns into a leaf node if it's not splitable.
+	template <typename Object, typename ObjectHasher>
+	void Quadtree<Object, ObjectHasher>::PruneEmptyLeafNode(NodeT* node, NodeSet& createdLeafNodes,
+		NodeSet& removedLeafNodes)
+	{
+		while (node != root && node->isLeaf && node->n + node->nr == 0)
+		{
+			auto parent = node->parent;
+			bool childless = true;
+			for (int i = 0; i < 4; i++)
+			{
+				if (parent->children[i] == node)
+					parent->children[i] = nullptr;
+				else if (parent->children[i] != nullptr)
+					childless = false;
+			}
+			if (createdLeafNodes.erase(node) == 0)
+				removedLeafNodes.insert(node);
+			RemoveLeafNode(node);
+			if (!childless
+				|| IsSplitable(parent->x1, parent->y1, parent->x2, parent->y2, parent->n + parent->nr))
+				return;
+			parent->isLeaf = true;
+			parent->skip = parent;
+			++numLeafNodes;
+			createdLeafNodes.insert(parent);
+			node = parent;
+		}
+	}
+
+	// Prunes the smallest node enclosing given range if it's an empty leaf node, in sparse mode.
+	// A non-leaf node without children turns into a leaf node first if it's not splitable any more.
+	template <typename Object, typename ObjectHasher>
+	void Quadtree<Object, ObjectHasher>::TryPrune(int x1, int y1, int x2, int y2)
+	{
+		auto node = FindSmallestNodeCoveringRange(x1, y1, x2, y2);
+		if (node == nullptr)
+			return;
+		NodeSet createdLeafNodes, removedLeafNodes;
+		if (!node->isLeaf && !IsSplitable(node->x1, node->y1, node->x2, node->y2, node->n + node->nr))
+		{
+			bool childless = true;
+			for (int i = 0; i < 4; i++)
+				childless = childless && node->children[i] == nullptr;
+			if (!childless)
+				return;
+			node->isLeaf = true;
+			node->skip = node;
+			++numLeafNodes;
+			createdLeafNodes.insert(node);
+			SyncOccupancy(node);
+		}
+		if (!node->isLeaf)
+			return;
+		if (node->n + node->nr > 0)
+		{
+			// Not empty, but it may be able to merge up now.
+			AfterRestructure(createdLeafNodes, removedLeafNodes);
+			TryMergeUp(node);
+			return;
+		}
+		PruneEmptyLeafNode(node, createdLeafNodes, removedLeafNodes);
+		AfterRestructure(createdLeafNodes, removedLeafNodes);
+	}
+
+	// ~~~~~~~~~~~ Occupancy Bitmaps ~~~~~~~~~~~~~
+
+	// Returns true if given node maintains an occupancy bitmap.
+	template <typename Object, typename ObjectHasher>
+	bool Quadtree<Object, ObjectHasher>::HasOccupancy(const NodeT* node) const
+	{
+		return occupancyBitmaps && node->isLeaf && node->x2 - node->x1 < 8 && node->y2 - node->y1 < 8;
+	}
+
+	// Recalculates the occupancy bitmap of given node from its objects container.
+	template <typename Object, typename ObjectHasher>
+	void Quadtree<Object, ObjectHasher>::SyncOccupancy(NodeT* node) const
+	{
+		if (!HasOccupancy(node))
+			return;
+		node->occupancy = 0;
+		for (const auto& k : node->objects)
+			node->occupancy |= 1ULL << ((k.y - node->y1) * 8 + (k.x - node->x1));
+	}
+
+	template <typename Object, typename ObjectHasher>
+	bool Quadtree<Object, ObjectHasher>::IsCellOccupied(int x, int y) const
+	{
+		auto node = Find(x, y);
+		if (node == nullptr || node->n == 0)
+			return false;
+		if (HasOccupancy(node))
+			return (node->occupancy >> ((y - node->y1) * 8 + (x - node->x1))) & 1;
+		if (!(x >= node->bx1 && x <= node->bx2 && y >= node->by1 && y <= node->by2))
+			return false;
+		for (const auto& k : node->objects)
+			if (k.x == x && k.y == y)
+				return true;
+		return false;
+	}
+
+	template <typename Object, typename ObjectHasher>
+	bool Quadtree<Object, ObjectHasher>::IsRectEmpty(int x1, int y1, int x2, int y2) const
+	{
+		if (!(x1 <= x2 && y1 <= y2))
+			return true;
+		x1 = std::max(x1, 0), y1 = std::max(y1, 0);
+		x2 = std::min(x2, w - 1), y2 = std::min(y2, h - 1);
+		return IsRectEmptyHelper(root, x1, y1, x2, y2);
+	}
+
+	template <typename Object, typename ObjectHasher>
+	bool Quadtree<Object, ObjectHasher>::IsRectEmptyHelper(const NodeT* node, int x1, int y1, int x2,
+		int y2) const
+	{
+		if (node == nullptr || node->n == 0)
+			return true;
+		// the objects are all inside the bounding box.
+		if (!isOverlap(node->bx1, node->by1, node->bx2, node->by2, x1, y1, x2, y2))
+			return true;
+		if (x1 <= node->x1 && node->x2 <= x2 && y1 <= node->y1 && node->y2 <= y2)
+			return false;
+		if (HasOccupancy(node))
+			return !(node->occupancy & OccupancyMask(node->x1, node->y1, node->x2, node->y2, x1, y1, x2, y2));
+		if (node->isLeaf || !node->objects.empty())
+		{
+			for (const auto& k : node->objects)
+				if (k.x >= x1 && k.x <= x2 && k.y >= y1 && k.y <= y2)
+					return false;
+			return true;
+		}
+		for (int i = 0; i < 4; i++)
+			if (!IsRectEmptyHelper(node->children[i], x1, y1, x2, y2))
+				return false;
+		return true;
+	}
+
+	template <typename Object, typename ObjectHasher>
+	int Quadtree<Object, ObjectHasher>::FirstOccupiedCellInRow(int y, int x1, int x2) const
+	{
+		if (!(y >= 0 && y < h))
+			return -1;
+		x1 = std::max(x1, 0), x2 = std::min(x2, w - 1);
+		if (x1 > x2)
+			return -1;
+		return FirstOccupiedCellInRowHelper(root, y, x1, x2);
+	}
+
+	template <typename Object, typename ObjectHasher>
+	int Quadtree<Object, ObjectHasher>::FirstOccupiedCellInRowHelper(const NodeT* node, int y, int x1,
+		int x2) const
+	{
+		if (node == nullptr || node->n == 0)
+			return -1;
+		if (!isOverlap(node->bx1, node->by1, node->bx2, node->by2, x1, y, x2, y))
+			return -1;
+		if (HasOccupancy(node))
+		{
+			// the bits of the row, masked by the columns inside [x1,x2].
+			auto bits = (node->occupancy >> ((y - node->y1) * 8)) & 0xff;
+			bits &= OccupancyMask(node->x1, node->y1, node->x2, node->y1, x1, node->y1, x2, node->y1);
+			if (bits == 0)
+				return -1;
+			int i = 0;
+			while (!((bits >> i) & 1))
+				++i;
+			return node->x1 + i;
+		}
+		if (node->isLeaf || !node->objects.empty())
+		{
+			int ans = -1;
+			for (const auto& k : node->objects)
+				if (k.y == y && k.x >= x1 && k.x <= x2 && (ans == -1 || k.x < ans))
+					ans = k.x;
+			return ans;
+		}
+		// the children on the row, from left to right.
+		int base = y <= node->y3 ? 0 : 2;
+		for (int i = base; i < base + 2; i++)
+		{
+			int ans = FirstOccupiedCellInRowHelper(node->children[i], y, x1, x2);
+			if (ans != -1)
+				return ans;
+		}
+		return -1;
+	}
+
+	// ~~~~~~~~~~~ Adaptive Refinement ~~~~~~~~~~~~~
+
+	// Adds one heat to given node, and remembers it if it was cold.
+	template <typename Object, typename ObjectHasher>
+	void Quadtree<Object, ObjectHasher>::Heat(NodeT* node) const
+	{
+		if (node->heat == 0)
+			warm.push_back(node->id);
+		node->heat += 1;
+	}
+
+	// Returns true if given node should stay split in adaptive mode.
+	template <typename Object, typename ObjectHasher>
+	bool Quadtree<Object, ObjectHasher>::IsHot(const NodeT* node) const
+	{
+		return adaptive && node->heat >= adaptiveOptions.keepHeat;
+	}
+
+	template <typename Object, typename ObjectHasher>
+	int Quadtree<Object, ObjectHasher>::Adapt()
+	{
+		if (!adaptive || warm.empty())
+			return 0;
+		// Resolves the ids, skipping the removed nodes and the duplicates.
+		// Deeper nodes go first, so a cold node's children are merged before itself, and the nodes
+		// removed by a merge are always visited already.
+		std::vector<NodeT*> nodes;
+		for (auto id : warm)
+		{
+			auto node = m.Find(id);
+			if (node != nullptr)
+				nodes.push_back(node);
+		}
+		warm.clear();
+		std::sort(nodes.begin(), nodes.end(),
+			[](const NodeT* a, const NodeT* b) { return a->d != b->d ? a->d > b->d : a < b; });
+		nodes.erase(std::unique(nodes.begin(), nodes.end()), nodes.end());
+
+		NodeSet createdLeafNodes, removedLeafNodes;
+		createdLeafNodes.swap(scratchCreatedLeafNodes);
+		removedLeafNodes.swap(scratchRemovedLeafNodes);
+		workLeft = budget > 0 ? budget : INT_MAX;
+		int k = 0;
+		for (auto node : nodes)
+		{
+			// Splits the hot leaf node, unless it's a single cell.
+			if (node->isLeaf && node->heat >= adaptiveOptions.splitHeat
+				&& (node->x1 < node->x2 || node->y1 < node->y2))
+			{
+				if (createdLeafNodes.erase(node) == 0)
+					removedLeafNodes.insert(node);
+				SplitHelper2(node, createdLeafNodes);
+				UpdateSkips(node->parent);
+				++k;
+			}
+			node->heat *= adaptiveOptions.decay;
+			if (node->heat >= adaptiveOptions.keepHeat)
+			{
+				warm.push_back(node->id);
+				continue;
+			}
+			node->heat = 0;
+			// Merges the cold node back if the ssf wants it to stop.
+			if (node->isLeaf || IsSplitable(node->x1, node->y1, node->x2, node->y2, node->n + node->nr))
+				continue;
+			bool mergeable = true;
+			for (int i = 0; i < 4; i++)
+				if (node->children[i] != nullptr && !node->children[i]->isLeaf)
+					mergeable = false;
+			if (mergeable)
+			{
+				MergeChildren(node, createdLeafNodes, removedLeafNodes);
+				UpdateSkips(node->parent);
+				++k;
+			}
+			else // waits for its children to merge first.
+				warm.push_back(node->id);
+		}
+		if (k > 0)
+			AfterRestructure(createdLeafNodes, removedLeafNodes);
+		createdLeafNodes.clear(), removedLeafNodes.clear();
+		scratchCreatedLeafNodes.swap(createdLeafNodes);
+		scratchRemovedLeafNodes.swap(removedLeafNodes);
+		return k;
+	}
+
+	// ~~~~~~~~~~~ Auto Tuning ~~~~~~~~~~~~~
+
+	template <typename Object, typename ObjectHasher>
+	void Quadtree<Object, ObjectHasher>::SetAutoTune(bool b, const AutoTuneOptions& options)
+	{
+		autoTune = b, tuneOptions = options;
+		tuneStats = TuneStats();
+		tuneStats.threshold = std::clamp(options.threshold, options.minThreshold, options.maxThreshold);
+		// The tree built with other split rules.
+		if (root != nullptr)
+			QueueLeafNodes();
+	}
+
+	template <typename Object, typename ObjectHasher>
+	bool Quadtree<Object, ObjectHasher>::Tune()
+	{
+		if (!autoTune || tuneStats.updates + tuneStats.queries < tuneOptions.minSamples)
+			return false;
+		// Moves towards the cheaper side, if one side costs more than twice the other.
+		auto churn = tuneStats.restructures * tuneOptions.restructureCost;
+		auto wasted = tuneStats.wasted;
+		int	 threshold = tuneStats.threshold;
+		if (churn > 2 * wasted)
+			threshold = std::min(threshold * 2, tuneOptions.maxThreshold);
+		else if (wasted > 2 * churn)
+			threshold = std::max(threshold / 2, tuneOptions.minThreshold);
+		tuneStats.updates = tuneStats.queries = tuneStats.scanned = 0;
+		tuneStats.wasted = tuneStats.restructures = 0;
+		if (threshold == tuneStats.threshold)
+			return false;
+		tuneStats.threshold = threshold;
+		++tuneStats.adjustments;
+		QueueLeafNodes();
+		return true;
+	}
+
+	// Queues all leaf nodes to restructure, they split or merge on Step.
+	template <typename Object, typename ObjectHasher>
+	void Quadtree<Object, ObjectHasher>::QueueLeafNodes()
+	{
+		VisitorT visitor = [this](NodeT* node) {
+			if (node->isLeaf)
+				pending.push_back(node->id);
+		};
+		m.ForEach(visitor);
+	}
+
+	// ~~~~~~~~~~~ Background Rebuild ~~~~~~~~~~~~~
+
+	template <typename Object, typename ObjectHasher>
+	bool Quadtree<Object, ObjectHasher>::StartRebuild()
+	{
+		if (rebuild != nullptr || root == nullptr)
+			return false;
+		// Snapshots the objects and the rectangle objects.
+		std::vector<BatchOperationItemT>	 items;
+		std::vector<RectObjectKey<Object>> rects;
+		items.reserve(numObjects);
+		rects.reserve(numRects);
+		VisitorT visitor = [&](NodeT* node) {
+			for (const auto& k : node->objects)
+				items.push_back({ k.x, k.y, k.o });
+			for (const auto& r : node->rects)
+				rects.push_back(r);
+		};
+		m.ForEach(visitor);
+
+		rebuild = std::make_unique<Rebuild>();
+		rebuild->tree = std::make_unique<Quadtree>(w, h, ssf);
+		CopySettings(*rebuild->tree);
+		auto t = rebuild->tree.get();
+		// keeps recycling, and avoids growing the table while building.
+		t->recycle = recycle;
+		t->m.Reserve(m.Capacity());
+		rebuild->worker = std::async(std::launch::async,
+			[t, items = std::move(items), rects = std::move(rects)]() {
+				// Adds all objects into the root leaf node, which then splits down at once.
+				t->root = t->CreateNode(true, 0, 0, 0, t->w - 1, t->h - 1);
+				t->BatchAddToLeafNode(t->root, items);
+				if (t->root->isLeaf)
+					t->TrySplitDown(t->root);
+				for (const auto& r : rects)
+					t->AddRect(r.x1, r.y1, r.x2, r.y2, r.o);
+			});
+		return true;
+	}
+
+	template <typename Object, typename ObjectHasher>
+	bool Quadtree<Object, ObjectHasher>::IsRebuildReady() const
+	{
+		return rebuild != nullptr
+			&& rebuild->worker.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+	}
+
+	template <typename Object, typename ObjectHasher>
+	bool Quadtree<Object, ObjectHasher>::FinishRebuild()
+	{
+		if (rebuild == nullptr)
+			return false;
+		auto worker = std::move(rebuild->worker);
+		auto fresh = std::move(rebuild->tree);
+		auto log = std::move(rebuild->log);
+		rebuild.reset();
+		// rethrows the exception from the worker thread, if any, the rebuild is abandoned then.
+		worker.get();
+		for (auto& mutation : log)
+			mutation(*fresh);
+		fresh->afterLeafCreated = afterLeafCreated, fresh->afterLeafRemoved = afterLeafRemoved;
+		fresh->budget = budget;
+		fresh->tuneStats = tuneStats;
+
+		// Diffs the leaf nodes by ids.
+		auto isLeafIn = [](const NodeTable<NodeT>& table, NodeId id) {
+			auto node = table.Find(id);
+			return node != nullptr && node->isLeaf;
+		};
+		if (afterLeafRemoved != nullptr)
+		{
+			VisitorT visitor = [&](NodeT* node) {
+				if (node->isLeaf && !isLeafIn(fresh->m, node->id))
+					afterLeafRemoved(node);
+			};
+			m.ForEach(visitor);
+		}
+		std::vector<NodeT*> created;
+		if (afterLeafCreated != nullptr)
+		{
+			VisitorT visitor = [&](NodeT* node) {
+				if (node->isLeaf && !isLeafIn(m, node->id))
+					created.push_back(node);
+			};
+			fresh->m.ForEach(visitor);
+		}
+
+		// Carries the pool over. An arena is freed with the old tree, so its pooled nodes can't outlive
+		// it, the fresh tree pools as many nodes from its own arena instead.
+		if (arena == nullptr)
+			fresh->pool.insert(fresh->pool.end(), pool.begin(), pool.end()), pool.clear();
+		else
+			for (std::size_t i = 0; i < pool.size(); i++)
+				fresh->pool.push_back(fresh->NewNode(true, 0, 0, 0, 0, 0));
+
+		// Swaps, the nodes are owned by pointers, moving them is cheap.
+		auto old = std::make_unique<Quadtree>(std::move(*this));
+		MoveFrom(*fresh);
+		for (auto node : created)
+			afterLeafCreated(node);
+		// Waits for the previous one, if it's still freeing.
+		reclaim = std::future<void>();
+		// The memory resource isn't required to be thread-safe beyond the rebuild.
+		if (mr != nullptr)
+			old.reset();
+		else
+			reclaim = std::async(std::launch::async, [old = std::move(old)]() mutable { old.reset(); });
+		return true;
+	}
+
+	// ~~~~~~~~~~~ Rectangle Objects ~~~~~~~~~~~~~
+
+	// Adds delta to the rectangle objects counter of given node and all its ancestors.
+	template <typename Object, typename ObjectHasher>
+	void Quadtree<Object, ObjectHasher>::UpdateNumRects(NodeT* node, int delta)
+	{
+		for (; node != nullptr; node = node->parent)
+			node->nr += delta;
+	}
+
+	// Moves up the rectangle objects in given node and all its descendants into rects.
+	template <typename Object, typename ObjectHasher>
+	void Quadtree<Object, ObjectHasher>::CollectRects(NodeT* node, RectObjectsT& rects) const
+	{
+		if (node == nullptr || node->nr == 0)
+			return;
+		for (const auto& r : node->rects)
+			rects.push_back(r);
+		node->rects.clear();
+		for (int i = 0; i < 4; i++)
+			CollectRects(node->children[i], rects);
+	}
+
+	// Syncs the structure of given non-leaf node whose own objects changed, it may turn to be a leaf
+	// node by merging its children.
+	template <typename Object, typename ObjectHasher>
+	void Quadtree<Object, ObjectHasher>::TrySyncNonLeafNode(NodeT* node)
+	{
+		// IsMergeable checks all the brothers, so any leaf child is ok here.
+		for (int i = 0; i < 4; i++)
+		{
+			auto child = node->children[i];
+			if (child != nullptr && child->isLeaf)
+			{
+				TryMergeUp(child);
+				return;
+			}
+		}
+	}
+
+	template <typename Object, typename ObjectHasher>
+	void Quadtree<Object, ObjectHasher>::AddRect(int x1, int y1, int x2, int y2, Object o)
+	{
+		if (rebuild != nullptr)
+			rebuild->log.push_back([=](Quadtree& t) { t.AddRect(x1, y1, x2, y2, o); });
+		if (!(x1 <= x2 && y1 <= y2) || root == nullptr)
+			return;
+		// find the smallest node enclosing the rectangle, with boundary checks.
+		auto node = FindSmallestNodeCoveringRange(x1, y1, x2, y2);
+		if (node == nullptr)
+			return;
+		RectObjectKey<Object> r{ x1, y1, x2, y2, o };
+		if (std::find(node->rects.begin(), node->rects.end(), r) != node->rects.end())
+			return;
+		// In sparse mode, the smallest enclosing node may be an absent child.
+		if (sparse)
+			node = Materialize(node, x1, y1, x2, y2);
+		node->rects.push_back(r);
+		++numRects;
+		UpdateNumRects(node, 1);
+		if (node->isLeaf)
+			TrySplitDown(node) || TryMergeUp(node);
+		else
+			TrySyncNonLeafNode(node);
+	}
+
+	template <typename Object, typename ObjectHasher>
+	void Quadtree<Object, ObjectHasher>::RemoveRect(int x1, int y1, int x2, int y2, Object o)
+	{
+		if (rebuild != nullptr)
+			rebuild->log.push_back([=](Quadtree& t) { t.RemoveRect(x1, y1, x2, y2, o); });
+		if (!(x1 <= x2 && y1 <= y2) || root == nullptr)
+			return;
+		auto node = FindSmallestNodeCoveringRange(x1, y1, x2, y2);
+		if (node == nullptr)
+			return;
+		RectObjectKey<Object> r{ x1, y1, x2, y2, o };
+		auto				  it = std::find(node->rects.begin(), node->rects.end(), r);
+		if (it == node->rects.end())
+			return;
+		*it = node->rects.back();
+		node->rects.pop_back();
+		--numRects;
+		UpdateNumRects(node, -1);
+		if (node->isLeaf)
+			TryMergeUp(node) || TrySplitDown(node);
+		else
+			TrySyncNonLeafNode(node);
+		if (sparse)
+			TryPrune(x1, y1, x2, y2);
+	}
+
+	template <typename Object, typename ObjectHasher>
+	void Quadtree<Object, ObjectHasher>::QueryRectsInRange(int x1, int y1, int x2, int y2,
+		RectCollectorT& collector) const
+	{
+		if (!(x1 <= x2 && y1 <= y2))
+			return;
+
+		x1 = std::max(x1, 0), y1 = std::max(y1, 0);
+		x2 = std::min(x2, w - 1), y2 = std::min(y2, h - 1);
+
+		// Starts from the root, since the ancestors of the smallest node enclosing the range may
+		// store rectangle objects overlapping with the range.
+		QueryRectsInRange(root, x1, y1, x2, y2, collector);
+	}
+
+	template <typename Object, typename ObjectHasher>
+	void Quadtree<Object, ObjectHasher>::QueryRectsInRange(int x1, int y1, int x2, int y2,
+		RectCollectorT&& collector) const
+	{
+		QueryRectsInRange(x1, y1, x2, y2, collector);
+	}
+
+	template <typename Object, typename ObjectHasher>
+	void Quadtree<Object, ObjectHasher>::QueryRectsInRange(NodeT* node, int x1, int y1, int x2, int y2,
+		RectCollectorT& collector) const
+	{
+		if (node == nullptr || node->nr == 0)
+			return;
+		if (!isOverlap(node->x1, node->y1, node->x2, node->y2, x1, y1, x2, y2))
+			return;
+		for (const auto& r : node->rects)
+			if (isOverlap(r.x1, r.y1, r.x2, r.y2, x1, y1, x2, y2))
+				collector(r.x1, r.y1, r.x2, r.y2, r.o);
+		for (int i = 0; i < 4; i++)
+			QueryRectsInRange(node->children[i], x1, y1, x2, y2, collector);
+	}
+
+	template <typename Object, typename ObjectHasher>
+	void Quadtree<Object, ObjectHasher>::ExportDensity(int cellSize, std::vector<int>& out) const
+	{
+		if (cellSize <= 0)
+			return;
+		int gw = (w + cellSize - 1) / cellSize, gh = (h + cellSize - 1) / cellSize;
+		out.assign(gw * gh, 0);
+		ExportDensityHelper(root, cellSize, gw, out);
+	}
+
+	template <typename Object, typename ObjectHasher>
+	void Quadtree<Object, ObjectHasher>::ExportDensityHelper(NodeT* node, int cellSize, int gw,
+		std::vector<int>& out) const
+	{
+		if (node == nullptr || node->n == 0)
+			return;
+		int gx1 = node->x1 / cellSize, gy1 = node->y1 / cellSize;
+		// The node is fully inside a single coarse cell.
+		if (gx1 == node->x2 / cellSize && gy1 == node->y2 / cellSize)
+		{
+			out[gy1 * gw + gx1] += node->n;
+			return;
+		}
+		if (node->isLeaf)
+		{
+			for (const auto& k : node->objects)
+				++out[(k.y / cellSize) * gw + (k.x / cellSize)];
+			return;
+		}
+		for (int i = 0; i < 4; i++)
+			ExportDensityHelper(node->children[i], cellSize, gw, out);
+	}
+
+	template <typename Object, typename ObjectHasher>
+	void Quadtree<Object, ObjectHasher>::QueryRangeLOD(int x1, int y1, int x2, int y2, int maxDepth,
+		VisitorT& visitor) const
+	{
+		if (!(x1 <= x2 && y1 <= y2) || root == nullptr)
+			return;
+
+		x1 = std::max(x1, 0), y1 = std::max(y1, 0);
+		x2 = std::min(x2, w - 1), y2 = std::min(y2, h - 1);
+		maxDepth = std::max(maxDepth, 0);
+
+		auto node = FindSmallestNodeCoveringRangeHelper(x1, y1, x2, y2, std::min<int>(maxDepth, maxd));
+		if (node == nullptr)
+			node = root;
+		QueryRangeLOD(node, x1, y1, x2, y2, maxDepth, visitor);
+	}
+
+	template <typename Object, typename ObjectHasher>
+	void Quadtree<Object, ObjectHasher>::QueryRangeLOD(int x1, int y1, int x2, int y2, int maxDepth,
+		VisitorT&& visitor) const
+	{
+		QueryRangeLOD(x1, y1, x2, y2, maxDepth, visitor);
+	}
+
+	template <typename Object, typename ObjectHasher>
+	void Quadtree<Object, ObjectHasher>::QueryRangeLOD(NodeT* node, int x1, int y1, int x2, int y2,
+		int maxDepth, VisitorT& visitor) const
+	{
+		if (node == nullptr || node->n == 0)
+			return;
+		if (!isOverlap(node->x1, node->y1, node->x2, node->y2, x1, y1, x2, y2))
+			return;
+		if (node->isLeaf || node->d >= maxDepth)
+		{
+			visitor(node);
+			return;
+		}
+		for (int i = 0; i < 4; i++)
+			QueryRangeLOD(node->children[i], x1, y1, x2, y2, maxDepth, visitor);
+	}
+
+	// ~~~~~~~~~~~ RegionQuadtree ~~~~~~~~~~~~~
+
+	// The structure of a region quadtree node.
+	// The value is meaningful only for a leaf node, all cells inside a leaf node share the same value.
+	template <typename Value>
+	struct RegionNode
+	{
+		bool isLeaf;
+		// d is the depth of this node in the tree, starting from 0.
+		uint8_t d;
+		// (x1,y1) and (x2,y2) are the upper-left and lower-right corners of the node's rectangle.
+		int x1, y1, x2, y2;
+		// Children: 0: left-top, 1: right-top, 2: left-bottom, 3: right-bottom
+		// For a leaf node, the children of which are all nullptr.
+		RegionNode* children[4];
+		// The parent node, nullptr for the root.
+		RegionNode* parent = nullptr;
+		// The value of all cells inside this leaf node.
+		Value value;
+
+		RegionNode(bool isLeaf, uint8_t d, int x1, int y1, int x2, int y2, const Value& value);
+		~RegionNode();
+	};
+
+	// RegionVisitor is the function that can access a region quadtree node.
+	template <typename Value>
+	using RegionVisitor = std::function<void(RegionNode<Value>*)>;
+
+	// RegionQuadtree is a region quadtree on a rectangle with width w and height h, where each cell
+	// holds a value.
+	// The type parameter Value is required to be comparable (the operator== must be available).
+	// e.g. RegionQuadtree<int>, RegionQuadtree<TerrainType>
+	//
+	// Every leaf node is a block of cells sharing the same value, the tree splits a leaf node once
+	// a cell inside it is set to a different value, and merges the 4 children back into their parent
+	// once they are all leaf nodes with the same value. So that the large uniform areas are stored in
+	// a few leaf nodes, instead of a dense array of cells.
+	template <typename Value>
+	class RegionQuadtree
+	{
+	public:
+		using NodeT = RegionNode<Value>;
+		using VisitorT = RegionVisitor<Value>;
+
+		// Creates a region quadtree on a w x h grid region, all cells are initialized to the given
+		// value.
+		RegionQuadtree(int w, int h, const Value& initial = Value{});
+		~RegionQuadtree();
+
+		// RegionQuadtree is not copyable, since the nodes are owned via raw pointers.
+		RegionQuadtree(const RegionQuadtree&) = delete;
+		RegionQuadtree& operator=(const RegionQuadtree&) = delete;
+
+		// RegionQuadtree is move constructible, the nodes are handed over without copying, and the
+		// moved-from tree is left without nodes, which can only be destroyed.
+		RegionQuadtree(RegionQuadtree&& other) noexcept;
+
+		// Returns the depth of the tree, starting from 0.
+		uint8_t Depth() const { return maxd; }
+
+		// Returns the number of nodes in this tree.
+		int NumNodes() const { return m.size(); }
+
+		// Returns the number of leaf nodes in this tree.
+		int NumLeafNodes() const { return numLeafNodes; }
+
+		// Returns the root node.
+		NodeT* GetRootNode() { return root; }
+
+		// Find the leaf node managing given position (x,y).
+		// If the given position crosses the bound, returns nullptr.
+		// The same to Quadtree::Find, the time complexity is O(log Depth).
+		NodeT* Find(int x, int y) const;
+
+		// Returns the value of the cell at position (x,y).
+		// Returns a default constructed Value if the given position crosses the bound.
+		Value GetCell(int x, int y) const;
+
+		// Sets the value of the cell at position (x,y).
+		// Does nothing if the given position crosses the bound.
+		void SetCell(int x, int y, const Value& value);
+
+		// Sets the value of all cells inside given rectangular range.
+		// The parameters (x1,y1) and (x2,y2) are the left-top and right-bottom corners of the given
+		// rectangle.
+		// Does nothing if x1 <= x2 && y1 <= y2 is not satisfied.
+		// We will limit the range to within the valid grid.
+		//
+		// A node fully covered by the range turns into a single leaf node in one step, the descendants
+		// of which are removed without visiting their cells, only the nodes crossing the range's
+		// edges are split.
+		void FillRect(int x1, int y1, int x2, int y2, const Value& value);
+
+		// Query the leaf nodes (uniform-valued blocks) overlapping with given rectangular range, the
+		// given visitor will be called for each leaf node hits.
+		// Does nothing if x1 <= x2 && y1 <= y2 is not satisfied.
+		// We will limit the query range to within the valid grid.
+		void QueryRange(int x1, int y1, int x2, int y2, VisitorT& visitor) const;
+		void QueryRange(int x1, int y1, int x2, int y2, VisitorT&& visitor) const;
+
+		// Returns the number of cells with given value inside given rectangular range.
+		// Returns 0 if x1 <= x2 && y1 <= y2 is not satisfied.
+		// We will limit the query range to within the valid grid.
+		int64_t CountCells(int x1, int y1, int x2, int y2, const Value& value) const;
+
+		// Traverse all nodes in this tree.
+		// The order is unstable, to traverse only the leaf nodes, filter by `node->isLeaf`.
+		void ForEachNode(VisitorT& visitor) const;
+
+	private:
+		NodeT* root = nullptr;
+		// width and height of the whole region.
+		const int w, h;
+		// maxd is the current maximum depth.
+		uint8_t maxd = 0;
+		// numDepthTable records how many nodes reaches every depth.
+		int numDepthTable[MAX_DEPTH];
+		// the number of leaf nodes in this tree.
+		int numLeafNodes = 0;
+		// cache the mappings between id and the node.
+		std::unordered_map<NodeId, NodeT*> m;
+
+		// ~~~~~~~~~~~ Internals ~~~~~~~~~~~~~
+		NodeT* CreateNode(uint8_t d, int x1, int y1, int x2, int y2, const Value& value);
+		void   RemoveNodes(NodeT* node);
+		void   Split(NodeT* node);
+		bool   TryMerge(NodeT* node);
+		void   FillRect(NodeT* node, int x1, int y1, int x2, int y2, const Value& value);
+		void   QueryRange(NodeT* node, int x1, int y1, int x2, int y2, VisitorT& visitor) const;
+	};
+
+	template <typename Value>
+	RegionNode<Value>::RegionNode(bool isLeaf, uint8_t d, int x1, int y1, int x2, int y2,
+		const Value& value)
+		: isLeaf(isLeaf), d(d), x1(x1), y1(y1), x2(x2), y2(y2), value(value)
+	{
+		memset(children, 0, sizeof children);
+	}
+
+	template <typename Value>
+	RegionNode<Value>::~RegionNode()
+	{
+		for (int i = 0; i < 4; i++)
+		{
+			if (children[i] != nullptr)
+			{
+				delete children[i];
+				children[i] = nullptr;
+			}
+		}
+	}
+
+	template <typename Value>
+	RegionQuadtree<Value>::RegionQuadtree(int w, int h, const Value& initial)
+		: w(w), h(h)
+	{
+		memset(numDepthTable, 0, sizeof numDepthTable);
+		root = CreateNode(0, 0, 0, w - 1, h - 1, initial);
+	}
+
+	template <typename Value>
+	RegionQuadtree<Value>::RegionQuadtree(RegionQuadtree&& other) noexcept
+		: root(other.root), w(other.w), h(other.h), maxd(other.maxd), numLeafNodes(other.numLeafNodes),
+		  m(std::move(other.m))
+	{
+		memcpy(numDepthTable, other.numDepthTable, sizeof numDepthTable);
+		other.root = nullptr;
+		other.m.clear();
+		memset(other.numDepthTable, 0, sizeof other.numDepthTable);
+		other.maxd = 0, other.numLeafNodes = 0;
+	}
+
+	template <typename Value>
+	RegionQuadtree<Value>::~RegionQuadtree()
+	{
+		m.clear();
+		delete root;
+		root = nullptr;
+	}
+
+	// Creates a new leaf node and adds it to the global node table.
+	template <typename Value>
+	RegionNode<Value>* RegionQuadtree<Value>::CreateNode(uint8_t d, int x1, int y1, int x2, int y2,
+		const Value& value)
+	{
+		auto node = new NodeT(true, d, x1, y1, x2, y2, value);
+		m.insert({ Pack(d, x1, y1, w, h), node });
+		++numLeafNodes;
+		maxd = std::max(maxd, d);
+		++numDepthTable[d];
+		return node;
+	}
+
+	// Removes given node and all its descendants from the global node table, and frees them.
+	template <typename Value>
+	void RegionQuadtree<Value>::RemoveNodes(NodeT* node)
+	{
+		for (int i = 0; i < 4; i++)
+		{
+			if (node->children[i] != nullptr)
+			{
+				RemoveNodes(node->children[i]);
+				node->children[i] = nullptr;
+			}
+		}
+		m.erase(Pack(node->d, node->x1, node->y1, w, h));
+		if (node->isLeaf)
+			--numLeafNodes;
+		--numDepthTable[node->d];
+		while (maxd > 0 && numDepthTable[maxd] == 0)
+			--maxd;
+		delete node;
+	}
+
+	// Splits given leaf node into children leaf nodes, which inherit the value of the node.
+	template <typename Value>
+	void RegionQuadtree<Value>::Split(NodeT* node)
+	{
+		int x1 = node->x1, y1 = node->y1, x2 = node->x2, y2 = node->y2;
+		int x3 = SplitMiddle(node->d, x1, x2, w), y3 = SplitMiddle(node->d, y1, y2, h);
+		// The same layout to Quadtree::SplitHelper2.
+		int rects[4][4] = {
+			{ x1, y1, x3, y3 },
+			{ x3 + 1, y1, x2, y3 },
+			{ x1, y3 + 1, x3, y2 },
+			{ x3 + 1, y3 + 1, x2, y2 },
+		};
+		for (int i = 0; i < 4; i++)
+		{
+			auto [a1, b1, a2, b2] = rects[i];
+			if (a1 <= a2 && b1 <= b2)
+			{
+				node->children[i] = CreateNode(node->d + 1, a1, b1, a2, b2, node->value);
+				node->children[i]->parent = node;
+			}
+		}
+		node->isLeaf = false;
+		--numLeafNodes;
+	}
+
+	// Merges the children of given non-leaf node into itself, if they are all leaf nodes with the
+	// same value.
+	// Returns true if the merging happens.
+	template <typename Value>
+	bool RegionQuadtree<Value>::TryMerge(NodeT* node)
+	{
+		if (node->isLeaf)
+			return false;
+		NodeT* first = nullptr;
+		for (int i = 0; i < 4; i++)
+		{
+			auto child = node->children[i];
+			if (child == nullptr)
+				continue;
+			if (!child->isLeaf)
+				return false;
+			if (first == nullptr)
+				first = child;
+			else if (!(child->value == first->value))
+				return false;
+		}
+		if (first == nullptr)
+			return false;
+		node->value = first->value;
+		for (int i = 0; i < 4; i++)
+		{
+			if (node->children[i] != nullptr)
+			{
+				RemoveNodes(node->children[i]);
+				node->children[i] = nullptr;
+			}
+		}
+		node->isLeaf = true;
+		++numLeafNodes;
+		return true;
+	}
+
+	template <typename Value>
+	RegionNode<Value>* RegionQuadtree<Value>::Find(int x, int y) const
+	{
+		if (!(x >= 0 && x < w && y >= 0 && y < h))
+			return nullptr;
+		// The same binary search on depth to Quadtree::Find.
+		int l = 0, r = maxd;
+		while (l <= r)
+		{
+			int	 d = (l + r) >> 1;
+			auto it = m.find(Pack(d, x, y, w, h));
+			if (it == m.end())
+				r = d - 1;
+			else if (it->second->isLeaf)
+				return it->second;
+			else
+				l = d + 1;
+		}
+		return nullptr;
+	}
+
+	template <typename Value>
+	Value RegionQuadtree<Value>::GetCell(int x, int y) const
+	{
+		auto node = Find(x, y);
+		if (node == nullptr)
+			return Value{};
+		return node->value;
+	}
+
+	template <typename Value>
+	void RegionQuadtree<Value>::SetCell(int x, int y, const Value& value)
+	{
+		FillRect(x, y, x, y, value);
+	}
+
+	template <typename Value>
+	void RegionQuadtree<Value>::FillRect(int x1, int y1, int x2, int y2, const Value& value)
+	{
+		if (!(x1 <= x2 && y1 <= y2))
+			return;
+		x1 = std::max(x1, 0), y1 = std::max(y1, 0);
+		x2 = std::min(x2, w - 1), y2 = std::min(y2, h - 1);
+		if (!(x1 <= x2 && y1 <= y2))
+			return;
+		FillRect(root, x1, y1, x2, y2, value);
+	}
+
+	template <typename Value>
+	void RegionQuadtree<Value>::FillRect(NodeT* node, int x1, int y1, int x2, int y2,
+		const Value& value)
+	{
+		if (node == nullptr)
+			return;
+		if (!isOverlap(node->x1, node->y1, node->x2, node->y2, x1, y1, x2, y2))
+			return;
+		// Fully covered: collapse the whole subtree into a single leaf node.
+		if (node->x1 >= x1 && node->x2 <= x2 && node->y1 >= y1 && node->y2 <= y2)
+		{
+			if (!node->isLeaf)
+			{
+				for (int i = 0; i < 4; i++)
+				{
+					if (node->children[i] != nullptr)
+					{
+						RemoveNodes(node->children[i]);
+						node->children[i] = nullptr;
+					}
+				}
+				node->isLeaf = true;
+				++numLeafNodes;
+			}
+			node->value = value;
+			return;
+		}
+		if (node->isLeaf)
+		{
+			if (node->value == value)
+				return;
+			Split(node);
+		}
+		for (int i = 0; i < 4; i++)
+			FillRect(node->children[i], x1, y1, x2, y2, value);
+		// The children may turn to be uniform now.
+		TryMerge(node);
+	}
+
+	template <typename Value>
+	void RegionQuadtree<Value>::QueryRange(int x1, int y1, int x2, int y2, VisitorT& visitor) const
+	{
+		if (!(x1 <= x2 && y1 <= y2))
+			return;
+		x1 = std::max(x1, 0), y1 = std::max(y1, 0);
+		x2 = std::min(x2, w - 1), y2 = std::min(y2, h - 1);
+		QueryRange(root, x1, y1, x2, y2, visitor);
+	}
+
+	template <typename Value>
+	void RegionQuadtree<Value>::QueryRange(int x1, int y1, int x2, int y2, VisitorT&& visitor) const
+	{
+		QueryRange(x1, y1, x2, y2, visitor);
+	}
+
+	template <typename Value>
+	void RegionQuadtree<Value>::QueryRange(NodeT* node, int x1, int y1, int x2, int y2,
+		VisitorT& visitor) const
+	{
+		if (node == nullptr)
+			return;
+		if (!isOverlap(node->x1, node->y1, node->x2, node->y2, x1, y1, x2, y2))
+			return;
+		if (node->isLeaf)
+		{
+			visitor(node);
+			return;
+		}
+		for (int i = 0; i < 4; i++)
+			QueryRange(node->children[i], x1, y1, x2, y2, visitor);
+	}
+
+	template <typename Value>
+	int64_t RegionQuadtree<Value>::CountCells(int x1, int y1, int x2, int y2, const Value& value) const
+	{
+		if (!(x1 <= x2 && y1 <= y2))
+			return 0;
+		x1 = std::max(x1, 0), y1 = std::max(y1, 0);
+		x2 = std::min(x2, w - 1), y2 = std::min(y2, h - 1);
+		int64_t	 cnt = 0;
+		VisitorT visitor = [&](NodeT* node) {
+			if (!(node->value == value))
+				return;
+			// area of the intersection.
+			int64_t a = std::min(x2, node->x2) - std::max(x1, node->x1) + 1;
+			int64_t b = std::min(y2, node->y2) - std::max(y1, node->y1) + 1;
+			cnt += a * b;
+		};
+		QueryRange(root, x1, y1, x2, y2, visitor);
+		return cnt;
+	}
+
+	template <typename Value>
+	void RegionQuadtree<Value>::ForEachNode(VisitorT& visitor) const
+	{
+		for (auto [id, node] : m)
+			visitor(node);
+	}
+
+	// ~~~~~~~~~~~ FloatQuadtree ~~~~~~~~~~~~~
+
+	// FloatObject is the object stored in the grid tree by a FloatQuadtree, carrying its exact
+	// position.
+	template <typename Object, typename Real>
+	struct FloatObject
+	{
+		Real   x, y;
+		Object o;
+		// FloatObject is comparable.
+		bool operator==(const FloatObject& other) const
+		{
+			return x == other.x && y == other.y && o == other.o;
+		}
+	};
+
+	// Hasher for FloatObject, noexcept if the ObjectHasher is, the same to ObjectKeyHasher.
+	template <typename Object, typename Real, typename ObjectHasher = std::hash<Object>>
+	struct FloatObjectHasher
+	{
+		std::size_t operator()(const FloatObject<Object, Real>& k) const
+			noexcept(noexcept(ObjectHasher{}(std::declval<const Object&>())))
+		{
+			// combine them via FNV hash.
+			std::size_t h = __FNV_BASE;
+			h ^= std::hash<Real>{}(k.x);
+			h *= __FNV_PRIME;
+			h ^= std::hash<Real>{}(k.y);
+			h *= __FNV_PRIME;
+			h ^= ObjectHasher{}(k.o);
+			h *= __FNV_PRIME;
+			return h;
+		}
+	};
+
+	// FloatCollector is the function that can collect the objects managed by a FloatQuadtree.
+	// The arguments is (x,y,object), where the (x,y) is the exact position of the object.
+	template <typename Object, typename Real>
+	using FloatCollector = std::function<void(Real, Real, Object)>;
+
+	// FloatQuadtree is a quadtree on real-valued coordinates, an adapter on top of the grid Quadtree.
+	// The region [0, w*cellSize) x [0, h*cellSize) is divided into w x h cells of the given size, each
+	// object is stored with its exact position in the leaf node managing the cell it falls in.
+	// Queries on the grid tree are limited to the cells overlapping the query shape, and the exact
+	// positions are tested inside the leaf scan, so the results need no post-filtering.
+	//
+	// The Real can be a floating-point type or an integer type for fixed-point coordinates, e.g.
+	// FloatQuadtree<Entity*, float>, FloatQuadtree<int, double>, FloatQuadtree<int, int32_t> (with
+	// cellSize 1024 for positions in 1/1024 units).
+	template <typename Object, typename Real = float, typename ObjectHasher = std::hash<Object>>
+	class FloatQuadtree
+	{
+	public:
+		using FloatObjectT = FloatObject<Object, Real>;
+		using TreeT = Quadtree<FloatObjectT, FloatObjectHasher<Object, Real, ObjectHasher>>;
+		using NodeT = typename TreeT::NodeT;
+		using VisitorT = typename TreeT::VisitorT;
+		using CollectorT = FloatCollector<Object, Real>;
+
+		FloatQuadtree(int w, int h, Real cellSize, // number of cells on x and y axis, and the cell size.
+			SplitingStopper ssf = nullptr,			   // function to stop node spliting
+			VisitorT		afterLeafCreated = nullptr, // callback to be called after leaf nodes created.
+			VisitorT		afterLeafRemoved = nullptr	// callback to be called after leaf nodes removed.
+			)
+			: cellSize(cellSize), tree(w, h, ssf, afterLeafCreated, afterLeafRemoved) {}
+
+		// Returns the underlying grid tree, e.g. to inspect the nodes.
+		// Objects inside the nodes are FloatObject structs, the (x,y) of the ObjectKey is the cell.
+		TreeT& GetTree() { return tree; }
+
+		// Returns the total number of objects managed by this tree.
+		int NumObjects() const { return tree.NumObjects(); }
+
+		// Build all nodes recursively on an empty tree.
+		void Build() { tree.Build(); }
+
+		// Returns the cell position on an axis for given coordinate.
+		// Negative coordinates (and NaN) map to -1, which is out of the grid.
+		int ToCell(Real v) const;
+
+		// Find the leaf node managing given position (x,y).
+		// If the given position crosses the bound, returns nullptr.
+		NodeT* Find(Real x, Real y) const { return tree.Find(ToCell(x), ToCell(y)); }
+
+		// Add a object located at exact position (x,y).
+		// Does nothing if the position crosses the bound.
+		void Add(Real x, Real y, Object o) { tree.Add(ToCell(x), ToCell(y), { x, y, o }); }
+
+		// Remove the object located at exact position (x,y).
+		// Does nothing if the object is not found.
+		void Remove(Real x, Real y, Object o) { tree.Remove(ToCell(x), ToCell(y), { x, y, o }); }
+
+		// Query the objects inside given rectangular range [x1,x2] x [y1,y2] (bounds included) on the
+		// exact positions, the given collector will be called for each object hits.
+		// Does nothing if x1 <= x2 && y1 <= y2 is not satisfied.
+		void QueryRange(Real x1, Real y1, Real x2, Real y2, CollectorT& collector) const;
+		void QueryRange(Real x1, Real y1, Real x2, Real y2, CollectorT&& collector) const;
+
+		// Query the objects within given distance r from the center (x,y) (bound included) on the
+		// exact positions, the given collector will be called for each object hits.
+		// Does nothing if r < 0.
+		void QueryRadius(Real x, Real y, Real r, CollectorT& collector) const;
+		void QueryRadius(Real x, Real y, Real r, CollectorT&& collector) const;
+
+	private:
+		// the size of a cell.
+		const Real cellSize;
+		// the underlying grid tree.
+		TreeT tree;
+	};
+
+	template <typename Object, typename Real, typename ObjectHasher>
+	int FloatQuadtree<Object, Real, ObjectHasher>::ToCell(Real v) const
+	{
+		if (!(v >= 0))
+			return -1;
+		auto c = v / cellSize;
+		// avoids int overflow, such positions are out of the grid anyway.
+		if (c >= Real(MAX_SIDE))
+			return MAX_SIDE;
+		return static_cast<int>(c);
+	}
+
+	template <typename Object, typename Real, typename ObjectHasher>
+	void FloatQuadtree<Object, Real, ObjectHasher>::QueryRange(Real x1, Real y1, Real x2, Real y2,
+		CollectorT& collector) const
+	{
+		if (!(x1 <= x2 && y1 <= y2))
+			return;
+		// the range in cells, the grid tree limits it to within the valid grid.
+		int cx1 = x1 < 0 ? 0 : ToCell(x1), cy1 = y1 < 0 ? 0 : ToCell(y1);
+		int cx2 = ToCell(x2), cy2 = ToCell(y2);
+		tree.QueryRange(cx1, cy1, cx2, cy2, [&](int, int, FloatObjectT k) {
+			if (k.x >= x1 && k.x <= x2 && k.y >= y1 && k.y <= y2)
+				collector(k.x, k.y, k.o);
+		});
+	}
+
+	template <typename Object, typename Real, typename ObjectHasher>
+	void FloatQuadtree<Object, Real, ObjectHasher>::QueryRange(Real x1, Real y1, Real x2, Real y2,
+		CollectorT&& collector) const
+	{
+		QueryRange(x1, y1, x2, y2, collector);
+	}
+
+	template <typename Object, typename Real, typename ObjectHasher>
+	void FloatQuadtree<Object, Real, ObjectHasher>::QueryRadius(Real x, Real y, Real r,
+		CollectorT& collector) const
+	{
+		if (!(r >= 0))
+			return;
+		// the bounding box of the circle in cells.
+		int cx1 = x - r < 0 ? 0 : ToCell(x - r), cy1 = y - r < 0 ? 0 : ToCell(y - r);
+		int cx2 = ToCell(x + r), cy2 = ToCell(y + r);
+		// the squares are computed in a wider type, avoids overflow for integral (fixed-point) Real.
+		using Wide = std::conditional_t<std::is_integral_v<Real>, int64_t, double>;
+		auto rr = Wide(r) * r;
+		tree.QueryRange(cx1, cy1, cx2, cy2, [&](int, int, FloatObjectT k) {
+			auto dx = Wide(k.x) - x, dy = Wide(k.y) - y;
+			if (dx * dx + dy * dy <= rr)
+				collector(k.x, k.y, k.o);
+		});
+	}
+
+	template <typename Object, typename Real, typename ObjectHasher>
+	void FloatQuadtree<Object, Real, ObjectHasher>::QueryRadius(Real x, Real y, Real r,
+		CollectorT&& collector) const
+	{
+		QueryRadius(x, y, r, collector);
+	}
+
+	// ~~~~~~~~~~~ BakedQuadtree ~~~~~~~~~~~~~
+
+	// BakedNode is a node of a BakedQuadtree, a flattened copy of a quadtree node.
+	struct BakedNode
+	{
+		// (x1,y1) and (x2,y2) are the upper-left and lower-right corners of the node's rectangle.
+		int x1, y1, x2, y2;
+		// (x3,y3) is the middle point spliting the children of a non-leaf node, the child containing
+		// position (x,y) is at index (x > x3) + 2 * (y > y3).
+		int x3, y3;
+		// The indexes of the children in the nodes array, -1 for the absent ones, all -1 for a leaf.
+		int children[4];
+		// The objects inside this node's rectangle are objects[begin, end) in the objects array, for
+		// both leaf and non-leaf nodes. So the number of them is end - begin.
+		int		begin, end;
+		uint8_t d;
+		bool	isLeaf;
+	};
+
+	// BakedVisitor is the function that can access a baked quadtree node.
+	using BakedVisitor = std::function<void(const BakedNode*)>;
+
+	// BakedQuadtree is a read-only snapshot of a quadtree, for static trees that are queried a lot
+	// and rarely changed. Rebake it from the source tree after changes.
+	//
+	// All nodes are stored in one array, in the van Emde Boas order: a tree of height h is cut at
+	// the middle level, the top half tree is laid out first, then each of the bottom trees, all
+	// recursively. So any subtree of height about log(B) sits in a contiguous block, where B is the
+	// number of nodes fit in a cache line (or a page), and a descent from the root touches
+	// O(log_B N) blocks, instead of a cache miss per level, without knowing B.
+	// Children are linked via indexes into the array, and the objects are copied into another array
+	// in the depth-first order of leaf nodes, the objects of any subtree are contiguous.
+	//
+	// Notes that the rectangle objects are not baked.
+	template <typename Object, typename ObjectHasher = std::hash<Object>>
+	class BakedQuadtree
+	{
+	public:
+		using QuadtreeT = Quadtree<Object, ObjectHasher>;
+		using SourceNodeT = typename QuadtreeT::NodeT;
+		using CollectorT = Collector<Object>;
+		using ObjectKeyT = ObjectKey<Object>;
+
+		// Bakes given tree, the tree should be built already.
+		explicit BakedQuadtree(const QuadtreeT& tree);
+
+		// Returns the depth of the tree, starting from 0.
+		uint8_t Depth() const { return maxd; }
+
+		// Returns the total number of objects.
+		int NumObjects() const { return objects.size(); }
+
+		// Returns the number of nodes.
+		int NumNodes() const { return nodes.size(); }
+
+		// Returns the root node, nullptr for an empty tree.
+		const BakedNode* GetRootNode() const { return nodes.empty() ? nullptr : &nodes[0]; }
+
+		// Returns the objects array, the objects inside a node are objects[node->begin, node->end).
+		const std::vector<ObjectKeyT>& GetObjects() const { return objects; }
+
+		// Find the leaf node managing given position (x,y).
+		// If the given position crosses the bound, returns nullptr.
+		// It descends from the root instead of the binary search on depth, since the nodes on the
+		// path are close to each other in the array.
+		const BakedNode* Find(int x, int y) const;
+
+		// Query objects located in given rectangular range, the given collector will be called for
+		// each object hits.
+		// The parameters (x1,y1) and (x2,y2) are the left-top and right-bottom corners of the given
+		// rectangle.
+		// Does nothing if x1 <= x2 && y1 <= y2 is not satisfied.
+		// The objects of a node fully covered by the range are collected in a single scan.
+		void QueryRange(int x1, int y1, int x2, int y2, CollectorT& collector) const;
+		void QueryRange(int x1, int y1, int x2, int y2, CollectorT&& collector) const;
+
+		// Traverse all nodes in the order of the array.
+		void ForEachNode(BakedVisitor& visitor) const;
+		void ForEachNode(BakedVisitor&& visitor) const;
+
+	private:
+		uint8_t					maxd = 0;
+		std::vector<BakedNode>	nodes;
+		std::vector<ObjectKeyT> objects;
+
+		// ~~~~~~~~~~~ Internals ~~~~~~~~~~~~~
+		void Layout(const SourceNodeT* node, int h, std::vector<const SourceNodeT*>& order) const;
+		void Frontier(const SourceNodeT* node, int d, std::vector<const SourceNodeT*>& frontier) const;
+		int	 Fill(const SourceNodeT* node, std::unordered_map<const SourceNodeT*, int>& index);
+	};
+
+	template <typename Object, typename ObjectHasher>
+	BakedQuadtree<Object, ObjectHasher>::BakedQuadtree(const QuadtreeT& tree)
+		: maxd(tree.Depth())
+	{
+		auto root = tree.GetRootNode();
+		if (root == nullptr)
+			return;
+		// Decides the order of the nodes.
+		std::vector<const SourceNodeT*> order;
+		order.reserve(tree.NumNodes());
+		Layout(root, maxd + 1, order);
+		std::unordered_map<const SourceNodeT*, int> index;
+		index.reserve(order.size());
+		for (int i = 0; i < (int)order.size(); i++)
+			index[order[i]] = i;
+		// Copies the nodes and objects.
+		nodes.resize(order.size());
+		objects.reserve(tree.NumObjects());
+		Fill(root, index);
+	}
+
+	// Lays out the subtree of given node into order, in the van Emde Boas order, where h is the
+	// number of levels to lay out from the node.
+	template <typename Object, typename ObjectHasher>
+	void BakedQuadtree<Object, ObjectHasher>::Layout(const SourceNodeT* node, int h,
+		std::vector<const SourceNodeT*>& order) const
+	{
+		if (h == 1)
+		{
+			order.push_back(node);
+			return;
+		}
+		// the top tree, and then the bottom trees rooted at the descendants right below it.
+		int top = h / 2;
+		Layout(node, top, order);
+		std::vector<const SourceNodeT*> frontier;
+		Frontier(node, node->d + top, frontier);
+		for (auto c : frontier)
+			Layout(c, h - top, order);
+	}
+
+	// Collects the descendants of given node at depth d, from left to right.
+	template <typename Object, typename ObjectHasher>
+	void BakedQuadtree<Object, ObjectHasher>::Frontier(const SourceNodeT* node, int d,
+		std::vector<const SourceNodeT*>& frontier) const
+	{
+		if (node->d == d)
+		{
+			frontier.push_back(node);
+			return;
+		}
+		if (node->isLeaf)
+			return;
+		for (int i = 0; i < 4; i++)
+			if (node->children[i] != nullptr)
+				Frontier(node->children[i], d, frontier);
+	}
+
+	// Copies given node and its descendants into the nodes array at the indexes decided by the
+	// layout, and their objects into the objects array in depth-first order.
+	// Returns the index of given node.
+	template <typename Object, typename ObjectHasher>
+	int BakedQuadtree<Object, ObjectHasher>::Fill(const SourceNodeT* node,
+		std::unordered_map<const SourceNodeT*, int>& index)
+	{
+		int	 k = index[node];
+		auto& b = nodes[k];
+		b.x1 = node->x1, b.y1 = node->y1, b.x2 = node->x2, b.y2 = node->y2;
+		b.x3 = b.x2, b.y3 = b.y2;
+		b.d = node->d, b.isLeaf = node->isLeaf;
+		b.begin = objects.size();
+		for (int i = 0; i < 4; i++)
+			b.children[i] = -1;
+		if (node->isLeaf)
+		{
+			for (auto& key : node->objects)
+				objects.push_back(key);
+		}
+		else
+		{
+			for (int i = 0; i < 4; i++)
+			{
+				auto c = node->children[i];
+				if (c == nullptr)
+					continue;
+				// the middle point is on the corner of any existing child, some children may be absent
+				// in sparse mode.
+				if (i & 1)
+					b.x3 = c->x1 - 1;
+				else
+					b.x3 = c->x2;
+				if (i & 2)
+					b.y3 = c->y1 - 1;
+				else
+					b.y3 = c->y2;
+				b.children[i] = Fill(c, index);
+			}
+		}
+		b.end = objects.size();
+		return k;
+	}
+
+	template <typename Object, typename ObjectHasher>
+	const BakedNode* BakedQuadtree<Object, ObjectHasher>::Find(int x, int y) const
+	{
+		if (nodes.empty())
+			return nullptr;
+		auto node = &nodes[0];
+		if (!(x >= node->x1 && x <= node->x2 && y >= node->y1 && y <= node->y2))
+			return nullptr;
+		while (!node->isLeaf)
+		{
+			int c = node->children[(x > node->x3) + 2 * (y > node->y3)];
+			// an implicit empty leaf node in sparse mode.
+			if (c < 0)
+				return nullptr;
+			node = &nodes[c];
+		}
+		return node;
+	}
+
+	template <typename Object, typename ObjectHasher>
+	void BakedQuadtree<Object, ObjectHasher>::QueryRange(int x1, int y1, int x2, int y2,
+		CollectorT& collector) const
+	{
+		if (!(x1 <= x2 && y1 <= y2) || nodes.empty())
+			return;
+		// depth-first with a stack on the call frame, at most 3 pending siblings per level.
+		int stack[3 * MAX_DEPTH + 4];
+		int top = 0;
+		stack[top++] = 0;
+		while (top > 0)
+		{
+			auto node = &nodes[stack[--top]];
+			if (node->begin == node->end)
+				continue;
+			if (!isOverlap(node->x1, node->y1, node->x2, node->y2, x1, y1, x2, y2))
+				continue;
+			if (x1 <= node->x1 && node->x2 <= x2 && y1 <= node->y1 && node->y2 <= y2)
+			{
+				// fully covered, all objects of this subtree hit.
+				for (int i = node->begin; i < node->end; i++)
+					collector(objects[i].x, objects[i].y, objects[i].o);
+				continue;
+			}
+			if (node->isLeaf)
+			{
+				for (int i = node->begin; i < node->end; i++)
+				{
+					auto& k = objects[i];
+					if (k.x >= x1 && k.x <= x2 && k.y >= y1 && k.y <= y2)
+						collector(k.x, k.y, k.o);
+				}
+				continue;
+			}
+			// pushes in reversed order, to visit the children from 0 to 3.
+			for (int i = 3; i >= 0; i--)
+				if (node->children[i] >= 0)
+					stack[top++] = node->children[i];
+		}
+	}
+
+	template <typename Object, typename ObjectHasher>
+	void BakedQuadtree<Object, ObjectHasher>::QueryRange(int x1, int y1, int x2, int y2,
+		CollectorT&& collector) const
+	{
+		QueryRange(x1, y1, x2, y2, collector);
+	}
+
+	template <typename Object, typename ObjectHasher>
+	void BakedQuadtree<Object, ObjectHasher>::ForEachNode(BakedVisitor& visitor) const
+	{
+		for (auto& node : nodes)
+			visitor(&node);
+	}
+
+	template <typename Object, typename ObjectHasher>
+	void BakedQuadtree<Object, ObjectHasher>::ForEachNode(BakedVisitor&& visitor) const
+	{
+		ForEachNode(visitor);
+	}
+
 } // namespace Quadtree
 
 #endif
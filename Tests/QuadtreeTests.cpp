@@ -1,6 +1,14 @@
 #include "Quadtree.hpp"
 
+#include <algorithm>
+#include <atomic>
 #include <catch2/catch_test_macros.hpp>
+#include <memory_resource>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
@@ -564,3 +572,1766 @@ TEST_CASE("BatchAddToLeafNode")
 	REQUIRE(tree.NumObjects() == 3);
 	REQUIRE(tree.NumLeafNodes() == 33);
 }
+
+TEST_CASE("SampleRange")
+{
+	Quadtree::SplitingStopper ssf = [](int w, int h, int n) { return (w <= 2 && h <= 2) || n <= 2; };
+	Quadtree::Quadtree<int>	  tree(30, 20, ssf);
+	tree.Build();
+	for (int i = 0; i < 30; i++)
+		tree.Add(i, (i * 7) % 20, i);
+	REQUIRE(tree.GetRootNode()->n == 30);
+
+	std::mt19937 rng(20241018);
+	// Samples inside [(5,0),(19,19)] are always inside the range.
+	std::unordered_map<int, int> hits;
+	tree.SampleRange(5, 0, 19, 19, 15000, rng, [&](int x, int y, int o) {
+		REQUIRE(x >= 5);
+		REQUIRE(x <= 19);
+		REQUIRE(o == x);
+		hits[o]++;
+	});
+	// Every object inside the range is picked, roughly uniformly.
+	REQUIRE(hits.size() == 15);
+	for (auto [o, cnt] : hits)
+	{
+		REQUIRE(cnt > 700);
+		REQUIRE(cnt < 1300);
+	}
+
+	// Empty range.
+	int n = 0;
+	tree.SampleRange(0, 19, 3, 19, 10, rng, [&](int x, int y, int o) { n++; });
+	REQUIRE(n == 0);
+
+	// Counters are maintained after removals.
+	for (int i = 0; i < 30; i += 2)
+		tree.Remove(i, (i * 7) % 20, i);
+	REQUIRE(tree.GetRootNode()->n == 15);
+	tree.SampleRange(0, 0, 29, 19, 100, rng, [&](int x, int y, int o) { REQUIRE(o % 2 == 1); });
+}
+
+TEST_CASE("ExportDensity")
+{
+	Quadtree::SplitingStopper ssf = [](int w, int h, int n) { return (w <= 2 && h <= 2) || n <= 1; };
+	Quadtree::Quadtree<int>	  tree(17, 11, ssf);
+	tree.Build();
+	std::vector<int> expect(5 * 3, 0);
+	for (int i = 0; i < 40; i++)
+	{
+		int x = (i * 5) % 17, y = (i * 3) % 11;
+		tree.Add(x, y, i);
+		expect[(y / 4) * 5 + (x / 4)]++;
+	}
+	std::vector<int> out;
+	tree.ExportDensity(4, out);
+	REQUIRE(out == expect);
+
+	// A single coarse cell covers the whole region.
+	tree.ExportDensity(100, out);
+	REQUIRE(out.size() == 1);
+	REQUIRE(out[0] == 40);
+}
+
+TEST_CASE("QueryRangeLOD")
+{
+	Quadtree::SplitingStopper ssf = [](int w, int h, int n) { return (w <= 2 && h <= 2) || n <= 1; };
+	Quadtree::Quadtree<int>	  tree(32, 32, ssf);
+	tree.Build();
+	std::mt19937 rng(78);
+	std::vector<std::pair<int, int>> positions;
+	for (int i = 0; i < 200; i++)
+	{
+		int x = rng() % 32, y = rng() % 32;
+		tree.Add(x, y, i);
+		positions.push_back({ x, y });
+	}
+	for (int i = 0; i < 200; i += 3)
+		tree.Remove(positions[i].first, positions[i].second, i);
+
+	// Clustering informations are consistent with the objects inside each node.
+	decltype(tree)::VisitorT checker = [&](Quadtree::Node<int>* node) {
+		int		n = 0;
+		int64_t sx = 0, sy = 0;
+		int		bx1 = 32, by1 = 32, bx2 = -1, by2 = -1;
+		tree.QueryRange(node->x1, node->y1, node->x2, node->y2, [&](int x, int y, int o) {
+			n++, sx += x, sy += y;
+			bx1 = std::min(bx1, x), by1 = std::min(by1, y);
+			bx2 = std::max(bx2, x), by2 = std::max(by2, y);
+		});
+		REQUIRE(node->n == n);
+		REQUIRE(node->sx == sx);
+		REQUIRE(node->sy == sy);
+		if (n > 0)
+		{
+			REQUIRE(node->bx1 == bx1);
+			REQUIRE(node->by1 == by1);
+			REQUIRE(node->bx2 == bx2);
+			REQUIRE(node->by2 == by2);
+		}
+	};
+	tree.ForEachNode(checker);
+
+	// Stops at depth 1, the clusters sum up to the objects inside the whole region.
+	int total = 0, numClusters = 0;
+	tree.QueryRangeLOD(0, 0, 31, 31, 1, [&](Quadtree::Node<int>* node) {
+		REQUIRE(node->d <= 1);
+		REQUIRE(node->n > 0);
+		total += node->n;
+		numClusters++;
+	});
+	REQUIRE(total == tree.NumObjects());
+	REQUIRE(numClusters <= 4);
+
+	// A small range visits only the clusters overlapping with it.
+	tree.QueryRangeLOD(0, 0, 3, 3, 1, [&](Quadtree::Node<int>* node) {
+		REQUIRE(node->x1 == 0);
+		REQUIRE(node->y1 == 0);
+	});
+}
+
+TEST_CASE("RegionQuadtree")
+{
+	Quadtree::RegionQuadtree<int> tree(13, 10, 0);
+	REQUIRE(tree.NumNodes() == 1);
+	REQUIRE(tree.NumLeafNodes() == 1);
+	REQUIRE(tree.GetCell(3, 4) == 0);
+
+	// A dense copy to check against.
+	std::vector<std::vector<int>> grid(10, std::vector<int>(13, 0));
+	auto						  fill = [&](int x1, int y1, int x2, int y2, int v) {
+		 tree.FillRect(x1, y1, x2, y2, v);
+		 for (int y = std::max(y1, 0); y <= std::min(y2, 9); y++)
+			 for (int x = std::max(x1, 0); x <= std::min(x2, 12); x++)
+				 grid[y][x] = v;
+	};
+	auto check = [&]() {
+		for (int y = 0; y < 10; y++)
+			for (int x = 0; x < 13; x++)
+				REQUIRE(tree.GetCell(x, y) == grid[y][x]);
+		// Leaf nodes are uniform blocks, no 4 brother leaf nodes share the same value.
+		decltype(tree)::VisitorT visitor = [&](Quadtree::RegionNode<int>* node) {
+			if (node->isLeaf)
+			{
+				for (int y = node->y1; y <= node->y2; y++)
+					for (int x = node->x1; x <= node->x2; x++)
+						REQUIRE(grid[y][x] == node->value);
+				return;
+			}
+			bool allSame = true;
+			int	 v = -1;
+			for (auto child : node->children)
+			{
+				if (child == nullptr)
+					continue;
+				if (!child->isLeaf || (v != -1 && v != child->value))
+					allSame = false;
+				v = child->value;
+			}
+			REQUIRE(!allSame);
+		};
+		tree.ForEachNode(visitor);
+	};
+
+	tree.SetCell(3, 4, 1);
+	grid[4][3] = 1;
+	check();
+	REQUIRE(tree.GetCell(3, 4) == 1);
+	REQUIRE(tree.NumLeafNodes() > 1);
+
+	fill(2, 2, 9, 7, 2);
+	check();
+	fill(-3, -3, 4, 20, 3);
+	check();
+	REQUIRE(tree.CountCells(0, 0, 12, 9, 3) == 5 * 10);
+	REQUIRE(tree.CountCells(0, 0, 12, 9, 2) == 5 * 6);
+	REQUIRE(tree.CountCells(0, 0, 12, 9, 0) == 13 * 10 - 5 * 10 - 5 * 6);
+
+	std::mt19937 rng(79);
+	for (int i = 0; i < 100; i++)
+	{
+		int x1 = rng() % 13, y1 = rng() % 10;
+		fill(x1, y1, x1 + rng() % 4, y1 + rng() % 4, rng() % 3);
+	}
+	check();
+
+	// Fill the whole region, collapses to a single leaf.
+	fill(0, 0, 12, 9, 5);
+	check();
+	REQUIRE(tree.NumNodes() == 1);
+	REQUIRE(tree.Depth() == 0);
+
+	// Not copyable, but the nodes can be moved into another tree.
+	static_assert(!std::is_copy_constructible_v<Quadtree::RegionQuadtree<int>>);
+	fill(1, 1, 2, 2, 6);
+	int							  numNodes = tree.NumNodes();
+	Quadtree::RegionQuadtree<int> moved(std::move(tree));
+	REQUIRE(moved.NumNodes() == numNodes);
+	REQUIRE(moved.GetCell(1, 1) == 6);
+	REQUIRE(moved.GetCell(5, 5) == 5);
+	REQUIRE(tree.NumNodes() == 0);
+}
+
+TEST_CASE("RemoveRange")
+{
+	int					   cnt = 0;
+	Quadtree::Visitor<int> afterLeafCreated = [&](Quadtree::Node<int>* node) { cnt++; };
+	Quadtree::Visitor<int> afterLeafRemoved = [&](Quadtree::Node<int>* node) { cnt--; };
+
+	Quadtree::SplitingStopper ssf = [](int w, int h, int n) { return (w <= 2 && h <= 2) || n <= 2; };
+	Quadtree::Quadtree<int>	  tree(40, 30, ssf, afterLeafCreated, afterLeafRemoved);
+	tree.Build();
+	std::mt19937								   rng(80);
+	std::vector<Quadtree::BatchOperationItem<int>> items;
+	for (int i = 0; i < 300; i++)
+	{
+		int x = rng() % 40, y = rng() % 30;
+		tree.Add(x, y, i);
+		items.push_back({ x, y, i });
+	}
+	REQUIRE(tree.NumLeafNodes() == cnt);
+
+	// Remove a range crossing many nodes.
+	tree.RemoveRange(5, 3, 27, 21);
+	REQUIRE(tree.NumLeafNodes() == cnt);
+	int n = 0;
+	tree.QueryRange(5, 3, 27, 21, [&](int x, int y, int o) { n++; });
+	REQUIRE(n == 0);
+
+	// The structure is the same to a tree built by adding the remaining objects.
+	Quadtree::Quadtree<int> expect(40, 30, ssf);
+	expect.Build();
+	int remaining = 0;
+	for (auto [x, y, o] : items)
+	{
+		if (x >= 5 && x <= 27 && y >= 3 && y <= 21)
+			continue;
+		expect.Add(x, y, o);
+		remaining++;
+	}
+	REQUIRE(tree.NumObjects() == remaining);
+	REQUIRE(tree.GetRootNode()->n == remaining);
+	REQUIRE(tree.NumNodes() == expect.NumNodes());
+	REQUIRE(tree.NumLeafNodes() == expect.NumLeafNodes());
+	REQUIRE(tree.Depth() == expect.Depth());
+
+	// Remove all, with a range crossing the boundary.
+	tree.RemoveRange(-10, -10, 100, 100);
+	REQUIRE(tree.NumObjects() == 0);
+	REQUIRE(tree.NumNodes() == 1);
+	REQUIRE(tree.NumLeafNodes() == cnt);
+}
+
+TEST_CASE("RemoveRange invert-ssf")
+{
+	// Removing objects may split leaf nodes with this ssf.
+	Quadtree::SplitingStopper ssf = [](int w, int h, int n) { return (n == 0) || (w * h == n); };
+	Quadtree::Quadtree<int>	  tree(8, 8, ssf);
+	tree.Build();
+	for (int y = 0; y < 4; y++)
+		for (int x = 0; x < 4; x++)
+			tree.Add(x, y, 1);
+	REQUIRE(tree.NumNodes() == 5);
+	tree.RemoveRange(1, 1, 2, 2);
+	REQUIRE(tree.NumObjects() == 12);
+	REQUIRE(tree.Find(0, 0)->x2 == 0);
+	REQUIRE(tree.Find(1, 1)->n == 0);
+	tree.RemoveRange(0, 0, 3, 3);
+	REQUIRE(tree.NumNodes() == 1);
+}
+
+TEST_CASE("RemoveIf")
+{
+	int					   cnt = 0;
+	Quadtree::Visitor<int> afterLeafCreated = [&](Quadtree::Node<int>* node) { cnt++; };
+	Quadtree::Visitor<int> afterLeafRemoved = [&](Quadtree::Node<int>* node) { cnt--; };
+
+	Quadtree::SplitingStopper ssf = [](int w, int h, int n) { return (w <= 2 && h <= 2) || n <= 2; };
+	Quadtree::Quadtree<int>	  tree(33, 27, ssf, afterLeafCreated, afterLeafRemoved);
+	tree.Build();
+	std::mt19937								   rng(81);
+	std::vector<Quadtree::BatchOperationItem<int>> items;
+	for (int i = 0; i < 300; i++)
+	{
+		int x = rng() % 33, y = rng() % 27;
+		tree.Add(x, y, i);
+		items.push_back({ x, y, i });
+	}
+
+	// Remove the odd objects inside a range.
+	tree.RemoveIfInRange(3, 4, 20, 25, [](int x, int y, int o) { return o % 2 == 1; });
+	REQUIRE(tree.NumLeafNodes() == cnt);
+	tree.QueryRange(3, 4, 20, 25, [](int x, int y, int o) { REQUIRE(o % 2 == 0); });
+
+	// Remove all objects divisible by 3.
+	tree.RemoveIf([](int x, int y, int o) { return o % 3 == 0; });
+	REQUIRE(tree.NumLeafNodes() == cnt);
+
+	Quadtree::Quadtree<int> expect(33, 27, ssf);
+	expect.Build();
+	for (auto [x, y, o] : items)
+	{
+		if (o % 3 == 0 || (o % 2 == 1 && x >= 3 && x <= 20 && y >= 4 && y <= 25))
+			continue;
+		expect.Add(x, y, o);
+	}
+	REQUIRE(tree.NumObjects() == expect.NumObjects());
+	REQUIRE(tree.GetRootNode()->n == expect.NumObjects());
+	REQUIRE(tree.NumNodes() == expect.NumNodes());
+	REQUIRE(tree.NumLeafNodes() == expect.NumLeafNodes());
+
+	tree.RemoveIf([](int x, int y, int o) { return true; });
+	REQUIRE(tree.NumObjects() == 0);
+	REQUIRE(tree.NumNodes() == 1);
+	REQUIRE(tree.NumLeafNodes() == cnt);
+}
+
+TEST_CASE("Rectangle objects")
+{
+	Quadtree::SplitingStopper ssf = [](int w, int h, int n) { return (w <= 2 && h <= 2) || n <= 1; };
+	Quadtree::Quadtree<int>	  tree(16, 16, ssf);
+	tree.Build();
+	// Stays at the root.
+	tree.AddRect(0, 0, 15, 15, 1);
+	REQUIRE(tree.NumRects() == 1);
+	REQUIRE(tree.NumNodes() == 1);
+	// The root splits, the whole-region object stays at the root.
+	tree.AddRect(1, 1, 2, 2, 2);
+	REQUIRE(tree.NumNodes() == 5);
+	REQUIRE(tree.GetRootNode()->rects.size() == 1);
+	REQUIRE(tree.GetRootNode()->nr == 2);
+	REQUIRE(tree.Find(0, 0)->rects.size() == 1);
+	// The left-top child splits, the objects move down.
+	tree.AddRect(4, 4, 5, 5, 3);
+	REQUIRE(tree.NumNodes() == 9);
+	REQUIRE(tree.Find(1, 1)->x2 == 3);
+	REQUIRE(tree.Find(1, 1)->rects.size() == 1);
+	REQUIRE(tree.Find(4, 4)->rects.size() == 1);
+	// Duplicate adding does nothing.
+	tree.AddRect(4, 4, 5, 5, 3);
+	REQUIRE(tree.NumRects() == 3);
+
+	// Each object is reported only once.
+	std::vector<int> hits;
+	tree.QueryRectsInRange(2, 2, 4, 4, [&](int x1, int y1, int x2, int y2, int o) { hits.push_back(o); });
+	std::sort(hits.begin(), hits.end());
+	REQUIRE(hits == std::vector<int>{ 1, 2, 3 });
+	hits.clear();
+	tree.QueryRectsInRange(10, 10, 12, 12, [&](int x1, int y1, int x2, int y2, int o) { hits.push_back(o); });
+	REQUIRE(hits == std::vector<int>{ 1 });
+
+	// Points and rectangles are counted together by the ssf.
+	tree.Add(12, 12, 4);
+	REQUIRE(tree.NumNodes() == 9);
+	tree.Add(13, 13, 5);
+	REQUIRE(tree.NumNodes() == 17);
+	// RemoveRange removes points only.
+	tree.RemoveRange(0, 0, 15, 15);
+	REQUIRE(tree.NumObjects() == 0);
+	REQUIRE(tree.NumRects() == 3);
+	REQUIRE(tree.NumNodes() == 9);
+
+	// Merges up.
+	tree.RemoveRect(4, 4, 5, 5, 3);
+	REQUIRE(tree.NumNodes() == 5);
+	tree.RemoveRect(0, 0, 15, 15, 1);
+	REQUIRE(tree.NumNodes() == 1);
+	REQUIRE(tree.GetRootNode()->rects.size() == 1);
+	// Not exist.
+	tree.RemoveRect(1, 1, 2, 2, 3);
+	REQUIRE(tree.NumRects() == 1);
+	tree.RemoveRect(1, 1, 2, 2, 2);
+	REQUIRE(tree.NumRects() == 0);
+	REQUIRE(tree.GetRootNode()->nr == 0);
+}
+
+TEST_CASE("FloatQuadtree")
+{
+	Quadtree::SplitingStopper			 ssf = [](int w, int h, int n) { return (w <= 2 && h <= 2) || n <= 3; };
+	Quadtree::FloatQuadtree<int, double> tree(20, 10, 0.5, ssf); // region [0,10) x [0,5)
+	tree.Build();
+
+	std::mt19937						   rng(11);
+	std::uniform_real_distribution<double> dx(0, 10), dy(0, 5);
+	std::vector<std::pair<double, double>> points;
+	for (int i = 0; i < 200; i++)
+	{
+		double x = dx(rng), y = dy(rng);
+		points.push_back({ x, y });
+		tree.Add(x, y, i);
+	}
+	REQUIRE(tree.NumObjects() == 200);
+	// Out of the bound.
+	tree.Add(-0.1, 1, 1000);
+	tree.Add(10.0, 1, 1000);
+	tree.Add(1, 1e30, 1000);
+	REQUIRE(tree.NumObjects() == 200);
+	REQUIRE(tree.Find(0.75, 0.25)->x1 <= 1);
+	REQUIRE(tree.Find(0.75, 5.0) == nullptr);
+
+	// Exact range.
+	std::vector<int> got, expect;
+	tree.QueryRange(1.3, 0.7, 6.1, 3.9, [&](double x, double y, int o) { got.push_back(o); });
+	for (int i = 0; i < 200; i++)
+	{
+		auto [x, y] = points[i];
+		if (x >= 1.3 && x <= 6.1 && y >= 0.7 && y <= 3.9)
+			expect.push_back(i);
+	}
+	std::sort(got.begin(), got.end());
+	REQUIRE(got == expect);
+
+	// Exact radius.
+	got.clear(), expect.clear();
+	tree.QueryRadius(4.2, 2.6, 1.7, [&](double x, double y, int o) {
+		REQUIRE(points[o] == std::make_pair(x, y));
+		got.push_back(o);
+	});
+	for (int i = 0; i < 200; i++)
+	{
+		auto [x, y] = points[i];
+		if ((x - 4.2) * (x - 4.2) + (y - 2.6) * (y - 2.6) <= 1.7 * 1.7)
+			expect.push_back(i);
+	}
+	std::sort(got.begin(), got.end());
+	REQUIRE(got == expect);
+	// A radius crossing the bound.
+	got.clear();
+	tree.QueryRadius(0, 0, 100, [&](double x, double y, int o) { got.push_back(o); });
+	REQUIRE(got.size() == 200);
+
+	for (int i = 0; i < 200; i++)
+		tree.Remove(points[i].first, points[i].second, i);
+	REQUIRE(tree.NumObjects() == 0);
+	REQUIRE(tree.GetTree().NumNodes() == 1);
+
+	// Fixed-point coordinates, in 1/16 units.
+	Quadtree::FloatQuadtree<int, int> tree2(8, 8, 16);
+	tree2.Build();
+	tree2.Add(17, 17, 1);
+	tree2.Add(31, 31, 2);
+	tree2.Add(32, 32, 3);
+	REQUIRE(tree2.Find(31, 31) == tree2.Find(16, 16));
+	got.clear();
+	tree2.QueryRange(17, 17, 31, 31, [&](int x, int y, int o) { got.push_back(o); });
+	std::sort(got.begin(), got.end());
+	REQUIRE(got == std::vector<int>{ 1, 2 });
+
+	// Fixed-point coordinates in 1/1024 units, the squared radius exceeds int32_t.
+	Quadtree::FloatQuadtree<int, int32_t> tree3(200, 200, 1024);
+	tree3.Build();
+	tree3.Add(0, 0, 1);
+	tree3.Add(60000, 0, 2);
+	tree3.Add(42426, 42426, 3); // 59999.3 away from the origin.
+	tree3.Add(42427, 42427, 4); // 60000.7 away from the origin.
+	tree3.Add(100000, 100000, 5);
+	got.clear();
+	tree3.QueryRadius(0, 0, 60000, [&](int32_t x, int32_t y, int o) { got.push_back(o); });
+	std::sort(got.begin(), got.end());
+	REQUIRE(got == std::vector<int>{ 1, 2, 3 });
+}
+
+TEST_CASE("Clone and move")
+{
+	Quadtree::SplitingStopper ssf = [](int w, int h, int n) { return (w <= 2 && h <= 2) || n <= 2; };
+	int						  numCreated = 0;
+	Quadtree::Quadtree<int>	  tree(30, 20, ssf, [&](Quadtree::Node<int>* node) { ++numCreated; });
+	tree.Build();
+	std::mt19937 rng(3);
+	for (int i = 0; i < 100; i++)
+		tree.Add(rng() % 30, rng() % 20, i);
+	tree.AddRect(1, 1, 20, 10, 1000);
+
+	auto collect = [](Quadtree::Quadtree<int>& t) {
+		std::vector<int> v;
+		t.QueryRange(0, 0, 29, 19, [&](int x, int y, int o) { v.push_back(o); });
+		std::sort(v.begin(), v.end());
+		return v;
+	};
+
+	// Clone copies everything.
+	int	 created = numCreated;
+	auto clone = tree.Clone();
+	REQUIRE(numCreated == created);
+	REQUIRE(clone.NumNodes() == tree.NumNodes());
+	REQUIRE(clone.NumLeafNodes() == tree.NumLeafNodes());
+	REQUIRE(clone.NumObjects() == 100);
+	REQUIRE(clone.NumRects() == 1);
+	REQUIRE(clone.Depth() == tree.Depth());
+	REQUIRE(collect(clone) == collect(tree));
+	REQUIRE(clone.GetRootNode() != tree.GetRootNode());
+	for (int x = 0; x < 30; x++)
+		for (int y = 0; y < 20; y++)
+		{
+			auto a = tree.Find(x, y), b = clone.Find(x, y);
+			REQUIRE(b != a);
+			REQUIRE(b->x1 == a->x1);
+			REQUIRE(b->y2 == a->y2);
+			REQUIRE(b->n == a->n);
+			REQUIRE(b->objects == a->objects);
+			REQUIRE(b->parent != nullptr);
+			REQUIRE(b->parent->x1 == a->parent->x1);
+			REQUIRE(b->parent->y1 == a->parent->y1);
+		}
+
+	// The clone is independent, and keeps the ssf and callbacks.
+	clone.RemoveRange(0, 0, 29, 19);
+	REQUIRE(clone.NumObjects() == 0);
+	REQUIRE(tree.NumObjects() == 100);
+	clone.Add(3, 3, 1);
+	clone.Add(4, 4, 2);
+	clone.Add(5, 5, 3);
+	REQUIRE(numCreated > created);
+	REQUIRE(clone.NumNodes() > 1);
+
+	// Move.
+	int						numNodes = tree.NumNodes();
+	auto					expect = collect(tree);
+	Quadtree::Quadtree<int> moved(std::move(tree));
+	REQUIRE(tree.NumNodes() == 0);
+	REQUIRE(tree.GetRootNode() == nullptr);
+	REQUIRE(moved.NumNodes() == numNodes);
+	REQUIRE(collect(moved) == expect);
+	clone = std::move(moved);
+	REQUIRE(moved.NumNodes() == 0);
+	REQUIRE(clone.NumNodes() == numNodes);
+	REQUIRE(collect(clone) == expect);
+
+	std::vector<Quadtree::Quadtree<int>> trees;
+	trees.push_back(clone.Clone());
+	trees.push_back(std::move(clone));
+	trees.emplace_back(10, 10);
+	REQUIRE(collect(trees[1]) == expect);
+	REQUIRE(collect(trees[0]) == expect);
+}
+
+TEST_CASE("Reserve and recycling nodes")
+{
+	Quadtree::SplitingStopper ssf = [](int w, int h, int n) { return (w <= 2 && h <= 2) || n <= 2; };
+	Quadtree::Quadtree<int>	  tree(32, 32, ssf);
+	tree.Reserve(200, 4);
+	REQUIRE(tree.NumPooledNodes() == 200);
+	tree.Build();
+	REQUIRE(tree.NumPooledNodes() == 199);
+
+	std::mt19937					 rng(5);
+	std::vector<std::pair<int, int>> points;
+	for (int i = 0; i < 40; i++)
+	{
+		points.push_back({ rng() % 32, rng() % 32 });
+		tree.Add(points[i].first, points[i].second, i);
+	}
+	// All nodes are taken from the pool, no more nodes are allocated.
+	REQUIRE(tree.NumNodes() > 1);
+	REQUIRE(tree.NumNodes() + tree.NumPooledNodes() == 200);
+
+	// Removed nodes go back to the pool, and they are recycled.
+	for (int round = 0; round < 3; round++)
+	{
+		for (int i = 0; i < 40; i++)
+			tree.Remove(points[i].first, points[i].second, i);
+		REQUIRE(tree.NumNodes() == 1);
+		REQUIRE(tree.NumPooledNodes() == 199);
+		for (int i = 0; i < 40; i++)
+			tree.Add(points[i].first, points[i].second, i);
+		REQUIRE(tree.NumNodes() + tree.NumPooledNodes() == 200);
+	}
+	tree.RemoveRange(0, 0, 15, 31);
+	REQUIRE(tree.NumNodes() + tree.NumPooledNodes() == 200);
+
+	// A recycled node starts clean.
+	Quadtree::Visitor<int> checker = [&](Quadtree::Node<int>* node) {
+		if (node->isLeaf)
+		{
+			REQUIRE(node->n == (int)node->objects.size());
+			for (auto [x, y, o] : node->objects)
+				REQUIRE((x >= node->x1 && x <= node->x2 && y >= node->y1 && y <= node->y2));
+		}
+		REQUIRE(node->nr == 0);
+	};
+	tree.ForEachNode(checker);
+	std::vector<int> objs;
+	tree.QueryRange(0, 0, 31, 31, [&](int x, int y, int o) { objs.push_back(o); });
+	for (auto o : objs)
+		REQUIRE(points[o].first >= 16);
+}
+
+TEST_CASE("NodeTable")
+{
+	struct TestNode
+	{
+		Quadtree::NodeId id;
+		TestNode*		 hnext = nullptr;
+	};
+	Quadtree::NodeTable<TestNode>					table;
+	std::unordered_map<Quadtree::NodeId, TestNode*> expect;
+	std::vector<TestNode>							nodes(5000);
+	std::mt19937_64									rng(9);
+	for (std::size_t i = 0; i < nodes.size(); i++)
+		nodes[i].id = rng();
+
+	REQUIRE(table.Find(nodes[0].id) == nullptr);
+	REQUIRE(table.Erase(nodes[0].id) == nullptr);
+
+	// Insert and erase randomly, the lookups stay correct during the incremental migrations.
+	std::vector<int> order(nodes.size());
+	for (std::size_t i = 0; i < order.size(); i++)
+		order[i] = i;
+	std::shuffle(order.begin(), order.end(), rng);
+	for (int round = 0; round < 3; round++)
+	{
+		for (auto i : order)
+		{
+			auto& node = nodes[i];
+			if (expect.count(node.id))
+			{
+				REQUIRE(table.Erase(node.id) == &node);
+				expect.erase(node.id);
+			}
+			else if (rng() % 3 != 0)
+			{
+				table.Insert(&node);
+				expect[node.id] = &node;
+			}
+			if (i % 97 == 0)
+			{
+				for (auto& k : nodes)
+				{
+					auto it = expect.find(k.id);
+					REQUIRE(table.Find(k.id) == (it == expect.end() ? nullptr : it->second));
+				}
+			}
+		}
+		REQUIRE(table.Size() == expect.size());
+		std::size_t cnt = 0;
+		table.ForEach([&](TestNode* node) {
+			REQUIRE(expect.at(node->id) == node);
+			++cnt;
+		});
+		REQUIRE(cnt == expect.size());
+	}
+
+	// Moving.
+	Quadtree::NodeTable<TestNode> table2(std::move(table));
+	REQUIRE(table.Size() == 0);
+	REQUIRE(table2.Size() == expect.size());
+	for (auto [id, node] : expect)
+		REQUIRE(table2.Find(id) == node);
+
+	table2.Clear();
+	REQUIRE(table2.Size() == 0);
+	for (auto [id, node] : expect)
+		REQUIRE(table2.Find(id) == nullptr);
+	table2.Reserve(10000);
+	table2.Insert(&nodes[0]);
+	REQUIRE(table2.Find(nodes[0].id) == &nodes[0]);
+}
+
+TEST_CASE("Budgeted restructuring")
+{
+	Quadtree::SplitingStopper ssf = [](int w, int h, int n) { return n <= 1; };
+	std::unordered_set<Quadtree::Node<int>*> leaves;
+	Quadtree::Visitor<int> afterLeafCreated = [&](Quadtree::Node<int>* node) { leaves.insert(node); };
+	Quadtree::Visitor<int> afterLeafRemoved = [&](Quadtree::Node<int>* node) { leaves.erase(node); };
+	Quadtree::Quadtree<int> tree(1024, 1024, ssf, afterLeafCreated, afterLeafRemoved);
+	Quadtree::Quadtree<int> expect(1024, 1024, ssf);
+	tree.SetBudget(2);
+	tree.Build();
+	expect.Build();
+
+	auto collect = [](Quadtree::Quadtree<int>& t, int x1, int y1, int x2, int y2) {
+		std::vector<int> v;
+		t.QueryRange(x1, y1, x2, y2, [&](int x, int y, int o) { v.push_back(o); });
+		std::sort(v.begin(), v.end());
+		return v;
+	};
+
+	// Two objects at neighbour cells, requires a split cascade down to the bottom.
+	tree.Add(100, 100, 1);
+	expect.Add(100, 100, 1);
+	tree.Add(101, 100, 2);
+	expect.Add(101, 100, 2);
+	REQUIRE(expect.Depth() == 10);
+	REQUIRE(tree.NumNodes() <= 1 + 4 * 2);
+	REQUIRE(tree.Depth() < 10);
+	REQUIRE(tree.NumPendingNodes() > 0);
+	// Queries are correct on the partially restructured tree.
+	REQUIRE(collect(tree, 0, 0, 1023, 1023) == std::vector<int>{ 1, 2 });
+	REQUIRE(collect(tree, 101, 0, 1023, 1023) == std::vector<int>{ 2 });
+	REQUIRE(tree.Find(100, 100)->objects.size() == 2);
+	REQUIRE((int)leaves.size() == tree.NumLeafNodes());
+
+	// Drain with Step.
+	int steps = 0;
+	while (tree.Step(2) > 0)
+		++steps;
+	REQUIRE(steps > 1);
+	REQUIRE(tree.Depth() == 10);
+	REQUIRE(tree.NumNodes() == expect.NumNodes());
+	REQUIRE(tree.Find(100, 100) != tree.Find(101, 100));
+	REQUIRE((int)leaves.size() == tree.NumLeafNodes());
+
+	// Merges are budgeted too.
+	tree.Remove(101, 100, 2);
+	expect.Remove(101, 100, 2);
+	REQUIRE(expect.NumNodes() == 1);
+	REQUIRE(tree.NumNodes() > 1);
+	REQUIRE(collect(tree, 0, 0, 1023, 1023) == std::vector<int>{ 1 });
+	while (tree.Step(2) > 0)
+		;
+	REQUIRE(tree.NumNodes() == 1);
+	REQUIRE(tree.Depth() == 0);
+	REQUIRE(leaves.size() == 1);
+
+	// Stale queued nodes are skipped.
+	tree.Add(500, 500, 3);
+	tree.Add(501, 501, 4);
+	REQUIRE(tree.NumPendingNodes() > 0);
+	tree.Remove(501, 501, 4);
+	while (tree.Step(2) > 0)
+		;
+	expect.Add(500, 500, 3);
+	REQUIRE(tree.NumNodes() == expect.NumNodes());
+	REQUIRE(tree.Find(500, 500)->x2 == expect.Find(500, 500)->x2);
+	REQUIRE(collect(tree, 0, 0, 1023, 1023) == std::vector<int>{ 1, 3 });
+}
+
+TEST_CASE("Sparse mode")
+{
+	Quadtree::SplitingStopper ssf = [](int w, int h, int n) { return n <= 1; };
+	int						  numLeaves = 0;
+	Quadtree::Visitor<int>	  afterLeafCreated = [&](Quadtree::Node<int>* node) { ++numLeaves; };
+	Quadtree::Visitor<int>	  afterLeafRemoved = [&](Quadtree::Node<int>* node) { --numLeaves; };
+	Quadtree::Quadtree<int>	  tree(100000, 100000, ssf, afterLeafCreated, afterLeafRemoved);
+	Quadtree::Quadtree<int>	  dense(100000, 100000, ssf);
+	tree.SetSparse(true);
+	tree.Build();
+	dense.Build();
+
+	tree.Add(1, 1, 1);
+	dense.Add(1, 1, 1);
+	tree.Add(2, 2, 2);
+	dense.Add(2, 2, 2);
+	REQUIRE(tree.Depth() == dense.Depth());
+	// Only the chain to the 2 objects is materialised.
+	REQUIRE(tree.NumLeafNodes() == 2);
+	REQUIRE(numLeaves == 2);
+	REQUIRE(tree.NumNodes() == tree.Depth() + 2);
+	REQUIRE(dense.NumNodes() > 3 * dense.Depth());
+	REQUIRE(tree.Find(1, 1)->objects.size() == 1);
+	REQUIRE(tree.Find(2, 2) != tree.Find(1, 1));
+	// Absent regions are implicit empty leaf nodes.
+	REQUIRE(tree.Find(90000, 90000) == nullptr);
+
+	// Adding into an absent region creates the leaf node.
+	tree.Add(90000, 90000, 3);
+	dense.Add(90000, 90000, 3);
+	REQUIRE(tree.Find(90000, 90000) != nullptr);
+	REQUIRE(tree.Find(90000, 90000)->d == 1);
+	REQUIRE(tree.NumLeafNodes() == 3);
+	REQUIRE(numLeaves == 3);
+
+	std::vector<int> objs;
+	tree.QueryRange(0, 0, 99999, 99999, [&](int x, int y, int o) { objs.push_back(o); });
+	std::sort(objs.begin(), objs.end());
+	REQUIRE(objs == std::vector<int>{ 1, 2, 3 });
+	objs.clear();
+	tree.QueryRange(2, 2, 90000, 90000, [&](int x, int y, int o) { objs.push_back(o); });
+	std::sort(objs.begin(), objs.end());
+	REQUIRE(objs == std::vector<int>{ 2, 3 });
+
+	// Neighbours skip the implicit empty leaf nodes.
+	std::vector<Quadtree::Node<int>*> neighbours;
+	Quadtree::Visitor<int>			  visitor = [&](Quadtree::Node<int>* node) { neighbours.push_back(node); };
+	auto a = tree.Find(1, 1);
+	REQUIRE(a->x2 == 1);
+	tree.FindNeighbourLeafNodes(a, 6, visitor); // SE
+	REQUIRE(neighbours.size() == 1);
+	REQUIRE(neighbours[0] == tree.Find(2, 2));
+	neighbours.clear();
+	tree.FindNeighbourLeafNodes(tree.Find(90000, 90000), 0, visitor); // N
+	REQUIRE(neighbours.empty());
+
+	// Removing prunes the empty leaf nodes.
+	tree.Remove(90000, 90000, 3);
+	REQUIRE(tree.NumLeafNodes() == 2);
+	REQUIRE(numLeaves == 2);
+	REQUIRE(tree.NumNodes() == tree.Depth() + 2);
+	tree.Remove(2, 2, 2);
+	REQUIRE(tree.NumNodes() == 1);
+	REQUIRE(tree.GetRootNode()->isLeaf);
+	REQUIRE(numLeaves == 1);
+
+	// Many objects in a huge grid, nodes proportional to the number of objects.
+	std::mt19937 rng(1);
+	for (int i = 0; i < 1000; i++)
+		tree.Add(rng() % 100000, rng() % 100000, 100 + i);
+	REQUIRE(tree.NumObjects() == 1001);
+	REQUIRE(tree.NumLeafNodes() <= 1001);
+	REQUIRE(numLeaves == tree.NumLeafNodes());
+	tree.RemoveRange(0, 0, 49999, 99999);
+	REQUIRE(numLeaves == tree.NumLeafNodes());
+	int cnt = 0;
+	Quadtree::Visitor<int> checker = [&](Quadtree::Node<int>* node) {
+		if (node->isLeaf)
+			REQUIRE(node->n > 0);
+		if (node->x2 < 50000)
+			++cnt;
+	};
+	tree.ForEachNode(checker);
+	REQUIRE(cnt == 0);
+	tree.RemoveRange(0, 0, 99999, 99999);
+	REQUIRE(tree.NumNodes() == 1);
+	REQUIRE(numLeaves == 1);
+
+	// Rectangle objects.
+	tree.AddRect(10, 10, 20, 20, 1);
+	REQUIRE(tree.NumNodes() == 1);
+	tree.AddRect(10, 10, 20, 20, 2);
+	// The node holding them is splitable, but none of its children is materialised.
+	REQUIRE(tree.NumNodes() > 1);
+	REQUIRE(tree.NumLeafNodes() == 0);
+	std::vector<int> rects;
+	tree.QueryRectsInRange(0, 0, 15, 15, [&](int x1, int y1, int x2, int y2, int o) { rects.push_back(o); });
+	REQUIRE(rects.size() == 2);
+	tree.RemoveRect(10, 10, 20, 20, 1);
+	REQUIRE(tree.NumNodes() == 1);
+	REQUIRE(numLeaves == 1);
+	tree.RemoveRect(10, 10, 20, 20, 2);
+	REQUIRE(tree.NumRects() == 0);
+	REQUIRE(tree.NumNodes() == 1);
+	REQUIRE(numLeaves == 1);
+}
+
+TEST_CASE("Compressed edges")
+{
+	using NodeT = Quadtree::Node<int>;
+	// The expected compressed edge of a node, by walking down the single non-empty children.
+	std::function<NodeT*(NodeT*)> expectSkip = [&](NodeT* node) {
+		while (!node->isLeaf && node->n > 0)
+		{
+			NodeT* only = nullptr;
+			int	   cnt = 0;
+			for (int i = 0; i < 4; i++)
+				if (node->children[i] != nullptr && node->children[i]->n > 0)
+					only = node->children[i], ++cnt;
+			if (cnt != 1)
+				break;
+			node = only;
+		}
+		return node;
+	};
+
+	for (bool sparse : { false, true })
+	{
+		Quadtree::SplitingStopper ssf = [](int w, int h, int n) { return n <= 1; };
+		Quadtree::Quadtree<int>	  tree(4096, 4096, ssf);
+		tree.SetSparse(sparse);
+		tree.Build();
+		Quadtree::Visitor<int> checker = [&](NodeT* node) { REQUIRE(node->skip == expectSkip(node)); };
+
+		// A tight cluster, the root jumps to the cluster directly.
+		tree.Add(1000, 1000, 1);
+		tree.Add(1001, 1001, 2);
+		tree.ForEachNode(checker);
+		auto root = tree.GetRootNode();
+		REQUIRE(root->skip != root);
+		REQUIRE(root->skip->x1 <= 1000);
+		REQUIRE(root->skip->x2 >= 1001);
+		REQUIRE(root->skip->d == tree.Depth() - 1);
+		REQUIRE(tree.Find(1000, 1000)->objects.size() == 1);
+		REQUIRE(tree.Find(1001, 1001)->objects.size() == 1);
+		REQUIRE(tree.FindSmallestNodeCoveringRange(1000, 1000, 1001, 1001) == root->skip);
+
+		std::mt19937					 rng(sparse ? 2 : 3);
+		std::vector<std::pair<int, int>> points;
+		for (int i = 0; i < 300; i++)
+		{
+			int x = 1000 + rng() % 64, y = 1000 + rng() % 64;
+			if (i % 3 == 0)
+				x = rng() % 4096, y = rng() % 4096;
+			points.push_back({ x, y });
+			tree.Add(x, y, 100 + i);
+		}
+		tree.ForEachNode(checker);
+		for (int i = 0; i < 300; i += 2)
+			tree.Remove(points[i].first, points[i].second, 100 + i);
+		tree.ForEachNode(checker);
+		tree.RemoveRange(0, 0, 1031, 4095);
+		tree.ForEachNode(checker);
+
+		// Queries are correct.
+		std::vector<int> got, expect;
+		tree.QueryRange(1020, 1020, 3000, 3000, [&](int x, int y, int o) { got.push_back(o); });
+		for (int i = 1; i < 300; i += 2)
+		{
+			auto [x, y] = points[i];
+			// the RemoveRange above removed all objects with x <= 1031.
+			if (x >= 1032 && x <= 3000 && y >= 1020 && y <= 3000)
+				expect.push_back(100 + i);
+		}
+		std::sort(got.begin(), got.end());
+		std::sort(expect.begin(), expect.end());
+		REQUIRE(got == expect);
+		for (int i = 1; i < 300; i += 2)
+		{
+			auto [x, y] = points[i];
+			auto node = tree.Find(x, y);
+			if (x >= 1032)
+			{
+				REQUIRE(node != nullptr);
+				REQUIRE(node->objects.count({ x, y, 100 + i }) == 1);
+			}
+		}
+
+		// A tight pair far away from the others, a compressed edge below a branching node.
+		tree.Add(3500, 3500, 1000);
+		tree.Add(3501, 3500, 1001);
+		tree.ForEachNode(checker);
+		// Both searches follow the compressed edges at every level, checks against plain descents.
+		auto descend = [&](int x, int y) {
+			auto node = tree.GetRootNode();
+			while (node != nullptr && !node->isLeaf)
+				node = node->children[(x > node->x3) + 2 * (y > node->y3)];
+			return node;
+		};
+		for (int i = 0; i < 2000; i++)
+		{
+			int x = rng() % 4096, y = rng() % 4096;
+			if (i % 2 == 0)
+				x = 3490 + rng() % 20, y = 3490 + rng() % 20;
+			REQUIRE(tree.FindByDepthSearch(x, y) == descend(x, y));
+			REQUIRE(tree.FindByDescent(x, y) == descend(x, y));
+		}
+		REQUIRE(tree.Find(3501, 3500)->objects.size() == 1);
+		auto pair = tree.FindSmallestNodeCoveringRange(3500, 3500, 3501, 3500);
+		REQUIRE(pair->n == 2);
+		REQUIRE(pair == pair->skip);
+		REQUIRE(pair->d == tree.Depth() - 1);
+		tree.RemoveRange(0, 0, 4095, 4095);
+		tree.ForEachNode(checker);
+		REQUIRE(tree.GetRootNode()->skip == tree.GetRootNode());
+	}
+}
+
+TEST_CASE("BakedQuadtree")
+{
+	for (auto sparse : { false, true })
+	{
+		Quadtree::SplitingStopper ssf = [](int w, int h, int n) { return n <= 3; };
+		Quadtree::Quadtree<int>	  tree(1000, 700, ssf);
+		tree.SetSparse(sparse);
+		tree.Build();
+		std::mt19937 rng(11);
+		std::vector<std::pair<int, int>> points;
+		for (int i = 0; i < 2000; i++)
+		{
+			int x = rng() % 1000, y = rng() % 700;
+			points.push_back({ x, y });
+			tree.Add(x, y, i);
+		}
+
+		Quadtree::BakedQuadtree<int> baked(tree);
+		REQUIRE(baked.NumNodes() == tree.NumNodes());
+		REQUIRE(baked.NumObjects() == 2000);
+		REQUIRE(baked.Depth() == tree.Depth());
+
+		// Parents are laid out before their children, and the ranges of objects are nested.
+		auto  root = baked.GetRootNode();
+		int	  numLeafNodes = 0;
+		Quadtree::BakedVisitor checker = [&](const Quadtree::BakedNode* node) {
+			int k = node - root;
+			if (node->isLeaf)
+				++numLeafNodes;
+			for (int i = 0; i < 4; i++)
+			{
+				if (node->children[i] < 0)
+					continue;
+				REQUIRE(node->children[i] > k);
+				auto c = root + node->children[i];
+				REQUIRE(c->d == node->d + 1);
+				REQUIRE(c->begin >= node->begin);
+				REQUIRE(c->end <= node->end);
+			}
+		};
+		baked.ForEachNode(checker);
+		REQUIRE(numLeafNodes == tree.NumLeafNodes());
+
+		// Find returns the same leaf nodes.
+		for (int x = 0; x < 1000; x += 7)
+			for (int y = 0; y < 700; y += 5)
+			{
+				auto a = tree.Find(x, y);
+				auto b = baked.Find(x, y);
+				REQUIRE((a == nullptr) == (b == nullptr));
+				if (a == nullptr)
+					continue;
+				REQUIRE(b->isLeaf);
+				REQUIRE(b->x1 == a->x1);
+				REQUIRE(b->y1 == a->y1);
+				REQUIRE(b->x2 == a->x2);
+				REQUIRE(b->y2 == a->y2);
+				REQUIRE(b->end - b->begin == (int)a->objects.size());
+			}
+		REQUIRE(baked.Find(1000, 0) == nullptr);
+		REQUIRE(baked.Find(0, -1) == nullptr);
+
+		// QueryRange returns the same objects.
+		int ranges[][4] = { { 0, 0, 999, 699 }, { 100, 50, 600, 400 }, { 333, 333, 333, 333 }, { 900, 600, 2000, 2000 }, { -5, -5, 10, 10 } };
+		for (auto& q : ranges)
+		{
+			std::vector<int> got, expect;
+			baked.QueryRange(q[0], q[1], q[2], q[3], [&](int x, int y, int o) {
+				REQUIRE(points[o] == std::make_pair(x, y));
+				got.push_back(o);
+			});
+			tree.QueryRange(q[0], q[1], q[2], q[3], [&](int x, int y, int o) { expect.push_back(o); });
+			std::sort(got.begin(), got.end());
+			std::sort(expect.begin(), expect.end());
+			REQUIRE(got == expect);
+		}
+	}
+
+	// An empty tree.
+	Quadtree::Quadtree<int>		 empty(10, 10);
+	Quadtree::BakedQuadtree<int> baked(empty);
+	REQUIRE(baked.NumNodes() == 0);
+	REQUIRE(baked.Find(0, 0) == nullptr);
+}
+
+TEST_CASE("Find by descent")
+{
+	for (auto sparse : { false, true })
+	{
+		Quadtree::SplitingStopper ssf = [](int w, int h, int n) { return n <= 2; };
+		Quadtree::Quadtree<int>	  tree(1 << 20, 3000, ssf);
+		tree.SetSparse(sparse);
+		tree.Build();
+		std::mt19937 rng(5);
+		// clustered points for a deep tree.
+		for (int i = 0; i < 500; i++)
+			tree.Add(rng() % 64, rng() % 64, i);
+		for (int i = 0; i < 500; i++)
+			tree.Add(rng() % (1 << 20), rng() % 3000, 500 + i);
+		REQUIRE(tree.Depth() > 12);
+		for (int i = 0; i < 20000; i++)
+		{
+			int x = rng() % (1 << 20), y = rng() % 3000;
+			if (i % 2)
+				x %= 100, y %= 100;
+			auto a = tree.FindByDepthSearch(x, y);
+			REQUIRE(tree.FindByDescent(x, y) == a);
+			REQUIRE(tree.Find(x, y) == a);
+		}
+		REQUIRE(tree.FindByDescent(-1, 0) == nullptr);
+		REQUIRE(tree.FindByDescent(0, 3000) == nullptr);
+		// Always descends.
+		tree.SetFindDescentDepth(Quadtree::MAX_DEPTH);
+		REQUIRE(tree.Find(3, 3) == tree.FindByDepthSearch(3, 3));
+		// The middle points are copied.
+		auto clone = tree.Clone();
+		REQUIRE(clone.FindByDescent(3, 3)->x1 == tree.Find(3, 3)->x1);
+	}
+}
+
+TEST_CASE("PackScaled")
+{
+	std::mt19937 rng(3);
+	for (int i = 0; i < 10000; i++)
+	{
+		int		 w = 1 + rng() % Quadtree::MAX_SIDE, h = 1 + rng() % 1000;
+		int		 x = rng() % w, y = rng() % h;
+		int		 D = rng() % (Quadtree::MAX_DEPTH + 1);
+		uint64_t qx = (uint64_t(x) << D) / w, qy = (uint64_t(y) << D) / h;
+		for (int d = 0; d <= D; d++)
+			REQUIRE(Quadtree::PackScaled(d, qx, qy, D) == Quadtree::Pack(d, x, y, w, h));
+	}
+}
+
+TEST_CASE("Huge page arena")
+{
+	Quadtree::HugePageArena arena(100);
+	std::vector<void*>		blocks;
+	for (int i = 0; i < 50000; i++)
+	{
+		auto p = arena.Allocate();
+		REQUIRE(reinterpret_cast<std::uintptr_t>(p) % alignof(std::max_align_t) == 0);
+		memset(p, i & 0xff, 100);
+		blocks.push_back(p);
+	}
+	// 112 bytes per block, 18724 blocks per chunk.
+	REQUIRE(arena.NumChunks() == 3);
+	// Freed blocks are reused.
+	for (int i = 0; i < 100; i++)
+		arena.Deallocate(blocks[i]);
+	std::unordered_set<void*> reused;
+	for (int i = 0; i < 100; i++)
+		reused.insert(arena.Allocate());
+	REQUIRE(reused == std::unordered_set<void*>(blocks.begin(), blocks.begin() + 100));
+	REQUIRE(arena.NumChunks() == 3);
+
+	for (auto policy : { Quadtree::AllocatorPolicy::HugePages, Quadtree::AllocatorPolicy::HugeTLB })
+	{
+		Quadtree::SplitingStopper ssf = [](int w, int h, int n) { return n <= 2; };
+		Quadtree::Quadtree<int>	  tree(3000, 2000, ssf), expect(3000, 2000, ssf);
+		tree.SetAllocatorPolicy(policy);
+		tree.Build();
+		expect.Build();
+		REQUIRE(tree.GetNodeArena() != nullptr);
+		REQUIRE(expect.GetNodeArena() == nullptr);
+		// Ignored on a non-empty tree.
+		tree.SetAllocatorPolicy(Quadtree::AllocatorPolicy::Default);
+		REQUIRE(tree.GetNodeArena() != nullptr);
+
+		std::mt19937 rng(9);
+		std::vector<std::pair<int, int>> points;
+		for (int i = 0; i < 3000; i++)
+		{
+			int x = rng() % 3000, y = rng() % 2000;
+			points.push_back({ x, y });
+			tree.Add(x, y, i);
+			expect.Add(x, y, i);
+		}
+		for (int i = 0; i < 3000; i += 3)
+		{
+			tree.Remove(points[i].first, points[i].second, i);
+			expect.Remove(points[i].first, points[i].second, i);
+		}
+		tree.RemoveRange(100, 100, 900, 900);
+		expect.RemoveRange(100, 100, 900, 900);
+		REQUIRE(tree.NumNodes() == expect.NumNodes());
+		REQUIRE(tree.GetNodeArena()->NumChunks() >= 1);
+
+		// Clone allocates from its own arena, and moving hands over the arena.
+		auto clone = tree.Clone();
+		REQUIRE(clone.GetNodeArena() != nullptr);
+		REQUIRE(clone.GetNodeArena() != tree.GetNodeArena());
+		auto arenaOfClone = clone.GetNodeArena();
+		Quadtree::Quadtree<int> moved(std::move(clone));
+		REQUIRE(moved.GetNodeArena() == arenaOfClone);
+		REQUIRE(clone.GetNodeArena() == nullptr);
+
+		for (int x = 0; x < 3000; x += 37)
+			for (int y = 0; y < 2000; y += 23)
+			{
+				auto a = tree.Find(x, y), b = expect.Find(x, y), c = moved.Find(x, y);
+				REQUIRE(a->x1 == b->x1);
+				REQUIRE(a->y2 == b->y2);
+				REQUIRE(a->objects == b->objects);
+				REQUIRE(c->x1 == b->x1);
+				REQUIRE(c->objects == b->objects);
+			}
+
+		// Recycling takes nodes from the arena too.
+		Quadtree::Quadtree<int> recycled(1000, 1000, ssf);
+		recycled.SetAllocatorPolicy(policy);
+		recycled.Reserve(1000);
+		REQUIRE(recycled.NumPooledNodes() == 1000);
+		recycled.Build();
+		for (int i = 0; i < 500; i++)
+			recycled.Add(rng() % 1000, rng() % 1000, i);
+		recycled.RemoveRange(0, 0, 999, 999);
+		REQUIRE(recycled.NumNodes() == 1);
+	}
+}
+
+// CountingResource counts the bytes allocated from it and not yet deallocated.
+struct CountingResource : std::pmr::memory_resource
+{
+	long long bytes = 0, numAllocations = 0;
+
+	void* do_allocate(std::size_t n, std::size_t align) override
+	{
+		bytes += n, ++numAllocations;
+		return std::pmr::new_delete_resource()->allocate(n, align);
+	}
+	void do_deallocate(void* p, std::size_t n, std::size_t align) override
+	{
+		bytes -= n;
+		std::pmr::new_delete_resource()->deallocate(p, n, align);
+	}
+	bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+};
+
+TEST_CASE("Memory resource")
+{
+	CountingResource		  counter;
+	Quadtree::SplitingStopper ssf = [](int w, int h, int n) { return n <= 2; };
+	{
+		Quadtree::Quadtree<int> tree(1000, 1000, ssf), expect(1000, 1000, ssf);
+		tree.SetMemoryResource(&counter);
+		REQUIRE(tree.GetMemoryResource() == &counter);
+		tree.Build();
+		expect.Build();
+		// Ignored on a non-empty tree.
+		tree.SetMemoryResource(nullptr);
+		REQUIRE(tree.GetMemoryResource() == &counter);
+		REQUIRE(counter.bytes > 0);
+
+		std::mt19937 rng(13);
+		for (int i = 0; i < 2000; i++)
+		{
+			int x = rng() % 1000, y = rng() % 1000;
+			tree.Add(x, y, i);
+			expect.Add(x, y, i);
+		}
+		tree.AddRect(10, 10, 300, 20, 1);
+		expect.AddRect(10, 10, 300, 20, 1);
+		// The nodes, objects and rectangle objects are all allocated from the resource.
+		auto bytes = counter.bytes;
+		REQUIRE(bytes >= (long long)tree.NumNodes() * (long long)sizeof(Quadtree::Node<int>));
+		tree.RemoveRange(0, 0, 499, 999);
+		expect.RemoveRange(0, 0, 499, 999);
+		REQUIRE(counter.bytes < bytes);
+		REQUIRE(tree.NumNodes() == expect.NumNodes());
+		for (int x = 0; x < 1000; x += 13)
+			for (int y = 0; y < 1000; y += 17)
+				REQUIRE(tree.Find(x, y)->objects == expect.Find(x, y)->objects);
+
+		// Clones share the resource, and moving hands it over.
+		auto clone = tree.Clone();
+		REQUIRE(clone.GetMemoryResource() == &counter);
+		Quadtree::Quadtree<int> moved(std::move(clone));
+		REQUIRE(moved.GetMemoryResource() == &counter);
+		REQUIRE(clone.GetMemoryResource() == nullptr);
+		REQUIRE(moved.NumNodes() == tree.NumNodes());
+
+		// Works together with the arena of nodes.
+		Quadtree::Quadtree<int> arena(1000, 1000, ssf);
+		arena.SetAllocatorPolicy(Quadtree::AllocatorPolicy::HugePages);
+		arena.SetMemoryResource(&counter);
+		arena.Build();
+		for (int i = 0; i < 500; i++)
+			arena.Add(rng() % 1000, rng() % 1000, i);
+		REQUIRE(arena.NumObjects() == 500);
+	}
+	// Everything is released.
+	REQUIRE(counter.bytes == 0);
+
+	// A monotonic buffer, e.g. for a per-frame tree.
+	std::pmr::monotonic_buffer_resource buffer(1 << 20);
+	{
+		Quadtree::Quadtree<int> tree(100, 100, ssf);
+		tree.SetMemoryResource(&buffer);
+		tree.Build();
+		for (int i = 0; i < 100; i++)
+			tree.Add(i, (i * 37) % 100, i);
+		int n = 0;
+		tree.QueryRange(0, 0, 99, 99, [&](int x, int y, int o) { ++n; });
+		REQUIRE(n == 100);
+	}
+}
+
+TEST_CASE("Object elements don't cache hash codes")
+{
+	// The hasher is noexcept for noexcept object hashers.
+	static_assert(noexcept(Quadtree::ObjectKeyHasher<int>{}(Quadtree::ObjectKey<int>{ 1, 2, 3 })));
+	static_assert(noexcept(Quadtree::ObjectKeyHasher<void*>{}(Quadtree::ObjectKey<void*>{ 1, 2, nullptr })));
+
+#if defined(__GLIBCXX__)
+	// So libstdc++ doesn't cache the hash codes, an element is just a next pointer and the key.
+	struct SizeRecorder : std::pmr::memory_resource
+	{
+		std::unordered_map<std::size_t, int> sizes;
+		void*								 do_allocate(std::size_t n, std::size_t align) override
+		{
+			++sizes[n];
+			return std::pmr::new_delete_resource()->allocate(n, align);
+		}
+		void do_deallocate(void* p, std::size_t n, std::size_t align) override
+		{
+			std::pmr::new_delete_resource()->deallocate(p, n, align);
+		}
+		bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+	} recorder;
+	Quadtree::Objects<int> objects(&recorder);
+	for (int i = 0; i < 100; i++)
+		objects.insert({ i, i, i });
+	auto elementSize = (sizeof(void*) + sizeof(Quadtree::ObjectKey<int>) + alignof(void*) - 1) / alignof(void*) * alignof(void*);
+	REQUIRE(recorder.sizes[elementSize] == 100);
+#endif
+}
+
+TEST_CASE("Occupancy bitmaps")
+{
+	for (auto bitmaps : { true, false })
+		for (auto sparse : { false, true })
+		{
+			// leaf nodes are either at most 8x8 cells, or with at most 3 objects.
+			Quadtree::SplitingStopper ssf = [](int w, int h, int n) { return (w <= 8 && h <= 8) || n <= 3; };
+			Quadtree::Quadtree<int>	  tree(100, 70, ssf);
+			tree.SetOccupancyBitmaps(bitmaps);
+			tree.SetSparse(sparse);
+			tree.Build();
+			// brute force: the number of objects at each cell.
+			std::vector<std::vector<int>> cnt(100, std::vector<int>(70, 0));
+			std::mt19937				  rng(17);
+			std::vector<std::tuple<int, int, int>> objects;
+
+			auto check = [&]() {
+				Quadtree::Quadtree<int>::VisitorT checker = [&](Quadtree::Node<int>* node) {
+					if (!bitmaps || !node->isLeaf || node->x2 - node->x1 >= 8 || node->y2 - node->y1 >= 8)
+						return;
+					for (int x = node->x1; x <= node->x2; x++)
+						for (int y = node->y1; y <= node->y2; y++)
+							REQUIRE(((node->occupancy >> ((y - node->y1) * 8 + (x - node->x1))) & 1) == (cnt[x][y] > 0));
+				};
+				tree.ForEachNode(checker);
+				for (int i = 0; i < 200; i++)
+				{
+					int x = rng() % 100, y = rng() % 70;
+					REQUIRE(tree.IsCellOccupied(x, y) == (cnt[x][y] > 0));
+					int x2 = x + rng() % 12, y2 = y + rng() % 12;
+					bool empty = true;
+					for (int a = x; a <= std::min(x2, 99); a++)
+						for (int b = y; b <= std::min(y2, 69); b++)
+							empty = empty && cnt[a][b] == 0;
+					REQUIRE(tree.IsRectEmpty(x, y, x2, y2) == empty);
+					int first = -1;
+					for (int a = x; a <= std::min(x2, 99) && first == -1; a++)
+						if (cnt[a][y] > 0)
+							first = a;
+					REQUIRE(tree.FirstOccupiedCellInRow(y, x, x2) == first);
+					std::vector<int> got, expect;
+					tree.QueryRange(x, y, x2, y2, [&](int, int, int o) { got.push_back(o); });
+					for (auto& [a, b, o] : objects)
+						if (a >= x && a <= x2 && b >= y && b <= y2)
+							expect.push_back(o);
+					std::sort(got.begin(), got.end());
+					std::sort(expect.begin(), expect.end());
+					REQUIRE(got == expect);
+				}
+			};
+
+			for (int i = 0; i < 600; i++)
+			{
+				// clustered, so that there're multiple objects in the same cell.
+				int x = rng() % 100, y = rng() % 70;
+				if (i % 3 == 0)
+					x = rng() % 10, y = rng() % 10;
+				tree.Add(x, y, i);
+				++cnt[x][y];
+				objects.push_back({ x, y, i });
+			}
+			check();
+			// removes a half, triggers merges.
+			for (int i = 0; i < 600; i += 2)
+			{
+				auto [x, y, o] = objects[i];
+				tree.Remove(x, y, o);
+				--cnt[x][y];
+			}
+			std::vector<std::tuple<int, int, int>> rest;
+			for (int i = 1; i < 600; i += 2)
+				rest.push_back(objects[i]);
+			objects = rest;
+			check();
+			tree.RemoveObjects(std::get<0>(objects[0]), std::get<1>(objects[0]));
+			tree.RemoveRange(20, 20, 60, 50);
+			rest.clear();
+			for (auto& [x, y, o] : objects)
+			{
+				bool removed = (x == std::get<0>(objects[0]) && y == std::get<1>(objects[0]))
+					|| (x >= 20 && x <= 60 && y >= 20 && y <= 50);
+				if (removed)
+					--cnt[x][y];
+				else
+					rest.push_back({ x, y, o });
+			}
+			objects = rest;
+			check();
+			// Clones keep the bitmaps.
+			auto clone = tree.Clone();
+			for (auto& [x, y, o] : objects)
+				REQUIRE(clone.IsCellOccupied(x, y));
+		}
+	Quadtree::Quadtree<int> tree(10, 10);
+	tree.Build();
+	REQUIRE(!tree.IsCellOccupied(-1, 0));
+	REQUIRE(tree.IsRectEmpty(5, 5, 4, 4));
+	REQUIRE(tree.FirstOccupiedCellInRow(10, 0, 9) == -1);
+}
+
+TEST_CASE("Adaptive refinement")
+{
+	// never splits by the ssf, there're at most 16 objects.
+	Quadtree::SplitingStopper ssf = [](int w, int h, int n) { return n <= 16; };
+	int						  numCreated = 0, numRemoved = 0;
+	Quadtree::Quadtree<int>	  tree(
+		  64, 64, ssf, [&](Quadtree::Node<int>* node) { ++numCreated; },
+		  [&](Quadtree::Node<int>* node) { ++numRemoved; });
+	tree.SetAdaptive(true);
+	tree.Build();
+	numCreated = 0;
+	// one object in each 16x16 block.
+	for (int x = 2; x < 64; x += 16)
+		for (int y = 2; y < 64; y += 16)
+			tree.Add(x, y, x * 64 + y);
+	REQUIRE(tree.NumLeafNodes() == 1);
+
+	auto query = [&](int times) {
+		for (int i = 0; i < times; i++)
+		{
+			std::vector<int> got;
+			tree.QueryRange(0, 0, 7, 7, [&](int x, int y, int o) { got.push_back(o); });
+			REQUIRE(got == std::vector<int>{ 2 * 64 + 2 });
+		}
+	};
+
+	// the root leaf node is scanned, but only 1 of the 16 objects is inside the range.
+	query(15);
+	REQUIRE(tree.Adapt() == 0);
+	REQUIRE(tree.NumLeafNodes() == 1);
+	query(16);
+	REQUIRE(tree.Adapt() == 1);
+	REQUIRE(tree.NumLeafNodes() == 4);
+	REQUIRE(tree.Depth() == 1);
+	REQUIRE(numCreated == 4);
+	REQUIRE(numRemoved == 1);
+
+	// then the top-left child, with 4 objects.
+	query(16);
+	REQUIRE(tree.Adapt() == 1);
+	REQUIRE(tree.NumLeafNodes() == 7);
+	REQUIRE(tree.Depth() == 2);
+	REQUIRE(tree.Find(2, 2)->x2 == 15);
+
+	// hot nodes don't merge on removal.
+	tree.Remove(18, 18, 18 * 64 + 18);
+	REQUIRE(tree.NumLeafNodes() == 7);
+	tree.Add(18, 18, 18 * 64 + 18);
+	query(1);
+
+	// cools down and merges back.
+	int rounds = 0;
+	while (tree.NumLeafNodes() > 1 && rounds < 20)
+		tree.Adapt(), ++rounds;
+	REQUIRE(rounds < 20);
+	REQUIRE(tree.Depth() == 0);
+	REQUIRE(numCreated - numRemoved == 0);
+	REQUIRE(tree.Adapt() == 0);
+	REQUIRE(tree.NumObjects() == 16);
+	query(1);
+
+	// nothing happens out of adaptive mode.
+	tree.SetAdaptive(false);
+	query(32);
+	REQUIRE(tree.Adapt() == 0);
+	REQUIRE(tree.NumLeafNodes() == 1);
+}
+
+TEST_CASE("Auto tuning")
+{
+	// only the auto-tuned threshold stops splitting.
+	Quadtree::SplitingStopper ssf = [](int w, int h, int n) { return w <= 1 && h <= 1; };
+	Quadtree::Quadtree<int>	  tree(64, 64, ssf);
+	Quadtree::AutoTuneOptions options;
+	options.threshold = 8, options.minThreshold = 2, options.maxThreshold = 32;
+	tree.SetAutoTune(true, options);
+	tree.Build();
+	REQUIRE(tree.GetTuneStats().threshold == 8);
+	// only the updates' restructuring counts.
+	REQUIRE(tree.GetTuneStats().restructures == 0);
+	std::vector<Quadtree::BatchOperationItem<int>> items;
+	for (int i = 0; i < 20; i++)
+		items.push_back({ i, i, -1 });
+	tree.BatchAddToLeafNode(tree.GetRootNode(), items);
+	REQUIRE(tree.NumLeafNodes() > 1);
+	tree.RemoveIfInRange(0, 0, 63, 63, [](int, int, int) { return true; });
+	REQUIRE(tree.NumLeafNodes() == 1);
+	REQUIRE(tree.GetTuneStats().restructures == 0);
+
+	std::mt19937												 rng(99);
+	std::vector<std::tuple<int, int, int>> objects;
+	for (int i = 0; i < 500; i++)
+	{
+		int x = rng() % 64, y = rng() % 64;
+		objects.push_back({ x, y, i });
+		tree.Add(x, y, i);
+	}
+
+	// every leaf node stops by the threshold, and every non-leaf node is above it.
+	auto check = [&]() {
+		int threshold = tree.GetTuneStats().threshold;
+		while (tree.NumPendingNodes() > 0)
+			tree.Step(100);
+		Quadtree::Quadtree<int>::VisitorT checker = [&](Quadtree::Node<int>* node) {
+			if (node->isLeaf)
+				REQUIRE((node->n <= threshold || (node->x1 == node->x2 && node->y1 == node->y2)));
+			else
+				REQUIRE(node->n > threshold);
+		};
+		tree.ForEachNode(checker);
+		REQUIRE(tree.NumObjects() == (int)objects.size());
+	};
+	check();
+	// building by adding is all about restructuring.
+	REQUIRE(tree.GetTuneStats().updates == 500);
+	REQUIRE(tree.Tune());
+	REQUIRE(tree.GetTuneStats().threshold == 16);
+	check();
+
+	// too few samples.
+	auto query = [&]() {
+		int x = rng() % 60, y = rng() % 60, got = 0, expect = 0;
+		tree.QueryRange(x, y, x + 3, y + 3, [&](int, int, int) { ++got; });
+		for (auto [ox, oy, o] : objects)
+			expect += ox >= x && ox <= x + 3 && oy >= y && oy <= y + 3;
+		REQUIRE(got == expect);
+	};
+	for (int i = 0; i < 10; i++)
+		query();
+	REQUIRE(tree.GetTuneStats().queries == 10);
+	REQUIRE(tree.GetTuneStats().wasted > 0);
+	REQUIRE(!tree.Tune());
+	REQUIRE(tree.GetTuneStats().queries == 10);
+
+	// query heavy workload lowers the threshold.
+	for (int i = 0; i < 100; i++)
+		query();
+	REQUIRE(tree.Tune());
+	REQUIRE(tree.GetTuneStats().threshold == 8);
+	REQUIRE(tree.GetTuneStats().adjustments == 2);
+	REQUIRE(tree.GetTuneStats().queries == 0);
+	check();
+	while (tree.GetTuneStats().threshold > 2)
+	{
+		for (int i = 0; i < 100; i++)
+			query();
+		REQUIRE(tree.Tune());
+		check();
+	}
+	// stays at the lower bound.
+	for (int i = 0; i < 100; i++)
+		query();
+	REQUIRE(!tree.Tune());
+	REQUIRE(tree.GetTuneStats().threshold == 2);
+
+	// update heavy workload raises the threshold.
+	for (int round = 0; round < 5; round++)
+	{
+		for (int i = 0; i < 200; i++)
+		{
+			auto& [x, y, o] = objects[rng() % objects.size()];
+			tree.Remove(x, y, o);
+			x = rng() % 64, y = rng() % 64;
+			tree.Add(x, y, o);
+		}
+		REQUIRE(tree.GetTuneStats().restructures > 0);
+		tree.Tune();
+		check();
+	}
+	REQUIRE(tree.GetTuneStats().threshold == 32);
+	for (int i = 0; i < 10; i++)
+		query();
+}
+
+TEST_CASE("Background rebuild")
+{
+	Quadtree::SplitingStopper ssf = [](int w, int h, int n) { return n <= 4; };
+	Quadtree::Quadtree<int>	  tree(64, 64, ssf);
+	tree.Build();
+	REQUIRE(!tree.FinishRebuild());
+
+	std::mt19937						   rng(100);
+	std::vector<std::tuple<int, int, int>> objects;
+	for (int i = 0; i < 300; i++)
+	{
+		int x = rng() % 64, y = rng() % 64;
+		objects.push_back({ x, y, i });
+		tree.Add(x, y, i);
+	}
+	tree.AddRect(3, 3, 40, 9, 1000);
+
+	auto leafIds = [&]() {
+		std::unordered_set<Quadtree::NodeId> ids;
+		Quadtree::Quadtree<int>::VisitorT	 visitor = [&](Quadtree::Node<int>* node) {
+			   if (node->isLeaf)
+				   ids.insert(node->id);
+		};
+		tree.ForEachNode(visitor);
+		return ids;
+	};
+	auto check = [&]() {
+		std::unordered_set<int> got, expect;
+		tree.QueryRange(0, 0, 63, 63, [&](int x, int y, int o) { got.insert(o); });
+		for (auto [x, y, o] : objects)
+			expect.insert(o);
+		REQUIRE(got == expect);
+		REQUIRE(tree.NumObjects() == (int)objects.size());
+	};
+
+	// the old tree restructures lazily in budgeted mode.
+	tree.SetBudget(1);
+	for (int i = 0; i < 200; i++)
+	{
+		auto& [x, y, o] = objects[i];
+		tree.Remove(x, y, o);
+	}
+	objects.erase(objects.begin(), objects.begin() + 200);
+	auto batchAdd = [&](int x, int y, int from, int to) {
+		auto											leaf = tree.Find(x, y);
+		std::vector<Quadtree::BatchOperationItem<int>> items;
+		for (int i = from; i < to; i++)
+		{
+			int x = leaf->x1 + rng() % (leaf->x2 - leaf->x1 + 1), y = leaf->y1 + rng() % (leaf->y2 - leaf->y1 + 1);
+			objects.push_back({ x, y, i });
+			items.push_back({ x, y, i });
+		}
+		tree.BatchAddToLeafNode(leaf, items);
+	};
+	batchAdd(44, 44, 400, 500);
+	REQUIRE(tree.NumPendingNodes() > 0);
+	check();
+
+	REQUIRE(tree.StartRebuild());
+	REQUIRE(tree.IsRebuilding());
+	REQUIRE(!tree.StartRebuild());
+	// mutations during the rebuild, the old tree keeps serving.
+	for (int i = 300; i < 350; i++)
+	{
+		int x = rng() % 64, y = rng() % 64;
+		objects.push_back({ x, y, i });
+		tree.Add(x, y, i);
+	}
+	tree.RemoveRange(0, 0, 15, 15);
+	std::erase_if(objects, [](auto& t) { return std::get<0>(t) <= 15 && std::get<1>(t) <= 15; });
+	// a stateful predicate, the replay removes the same objects.
+	int						calls = 0;
+	std::unordered_set<int> gone;
+	tree.RemoveIfInRange(32, 0, 63, 31, [&](int x, int y, int o) {
+		if (++calls % 2 == 0)
+			return false;
+		gone.insert(o);
+		return true;
+	});
+	REQUIRE(gone.size() > 1);
+	std::erase_if(objects, [&](auto& t) { return gone.count(std::get<2>(t)) > 0; });
+	tree.RemoveRect(3, 3, 40, 9, 1000);
+	tree.AddRect(20, 20, 30, 30, 1001);
+	batchAdd(50, 10, 500, 520);
+	check();
+
+	// the hooks maintain the ids of the leaf nodes by the difference.
+	auto leaves = leafIds();
+	int	 numCreated = 0, numRemoved = 0;
+	tree.SetAfterLeafCreatedCallback([&](Quadtree::Node<int>* node) {
+		REQUIRE(leaves.insert(node->id).second);
+		++numCreated;
+	});
+	tree.SetAfterLeafRemovedCallback([&](Quadtree::Node<int>* node) {
+		REQUIRE(leaves.erase(node->id) == 1);
+		++numRemoved;
+	});
+	REQUIRE(tree.FinishRebuild());
+	REQUIRE(!tree.IsRebuilding());
+	REQUIRE(!tree.IsRebuildReady());
+	REQUIRE(numCreated > 0);
+	REQUIRE(numRemoved > 0);
+	REQUIRE(leaves == leafIds());
+	REQUIRE(tree.NumPendingNodes() == 0);
+	check();
+	// fully restructured by the ssf.
+	Quadtree::Quadtree<int>::VisitorT visitor = [&](Quadtree::Node<int>* node) {
+		if (node->isLeaf)
+			REQUIRE(node->n <= 4);
+		else
+			REQUIRE(node->n > 4);
+	};
+	tree.ForEachNode(visitor);
+	std::vector<int> rects;
+	tree.QueryRectsInRange(0, 0, 63, 63, [&](int, int, int, int, int o) { rects.push_back(o); });
+	REQUIRE(rects == std::vector<int>{ 1001 });
+
+	// nothing changes, rebuilds again.
+	numCreated = 0, numRemoved = 0;
+	REQUIRE(tree.StartRebuild());
+	while (!tree.IsRebuildReady())
+		std::this_thread::yield();
+	REQUIRE(tree.FinishRebuild());
+	REQUIRE(numCreated == 0);
+	REQUIRE(numRemoved == 0);
+	check();
+	tree.SetAfterLeafCreatedCallback(nullptr);
+	tree.SetAfterLeafRemovedCallback(nullptr);
+	for (auto [x, y, o] : objects)
+		tree.Remove(x, y, o);
+	objects.clear();
+	check();
+
+	// with a memory resource, the old tree is freed on the calling thread.
+	struct ThreadRecorder : std::pmr::memory_resource
+	{
+		std::thread::id	 owner = std::this_thread::get_id();
+		std::atomic<int> foreign = 0;
+		void*			 do_allocate(std::size_t n, std::size_t align) override
+		{
+			return std::pmr::new_delete_resource()->allocate(n, align);
+		}
+		void do_deallocate(void* p, std::size_t n, std::size_t align) override
+		{
+			if (std::this_thread::get_id() != owner)
+				++foreign;
+			std::pmr::new_delete_resource()->deallocate(p, n, align);
+		}
+		bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+	} recorder;
+	{
+		Quadtree::Quadtree<int> tree2(64, 64, ssf);
+		tree2.SetMemoryResource(&recorder);
+		tree2.Build();
+		for (int i = 0; i < 100; i++)
+			tree2.Add(rng() % 64, rng() % 64, i);
+		REQUIRE(tree2.StartRebuild());
+		while (!tree2.IsRebuildReady())
+			std::this_thread::yield();
+		// the worker may free while building.
+		recorder.foreign = 0;
+		REQUIRE(tree2.FinishRebuild());
+		REQUIRE(tree2.NumObjects() == 100);
+	}
+	REQUIRE(recorder.foreign == 0);
+
+	// a failed rebuild is abandoned, the tree keeps working.
+	auto main = std::this_thread::get_id();
+	Quadtree::SplitingStopper failing = [main](int w, int h, int n) {
+		if (std::this_thread::get_id() != main)
+			throw std::runtime_error("ssf fails");
+		return n <= 4;
+	};
+	Quadtree::Quadtree<int> tree3(64, 64, failing);
+	tree3.Build();
+	for (int i = 0; i < 100; i++)
+		tree3.Add(rng() % 64, rng() % 64, i);
+	REQUIRE(tree3.StartRebuild());
+	tree3.Add(1, 1, 100);
+	REQUIRE_THROWS_AS(tree3.FinishRebuild(), std::runtime_error);
+	REQUIRE(!tree3.IsRebuilding());
+	REQUIRE(!tree3.FinishRebuild());
+	REQUIRE(tree3.NumObjects() == 101);
+	REQUIRE(tree3.StartRebuild());
+	REQUIRE_THROWS_AS(tree3.FinishRebuild(), std::runtime_error);
+
+	// the recycling mode and the pool survive a rebuild.
+	for (auto policy : { Quadtree::AllocatorPolicy::Default, Quadtree::AllocatorPolicy::HugePages })
+	{
+		Quadtree::Quadtree<int> tree4(64, 64, ssf);
+		tree4.SetAllocatorPolicy(policy);
+		tree4.Build();
+		tree4.Reserve(256, 4);
+		std::vector<std::tuple<int, int, int>> added;
+		for (int i = 0; i < 50; i++)
+		{
+			added.push_back({ rng() % 64, rng() % 64, i });
+			tree4.Add(std::get<0>(added.back()), std::get<1>(added.back()), i);
+		}
+		int pooled = tree4.NumPooledNodes();
+		REQUIRE(tree4.StartRebuild());
+		REQUIRE(tree4.FinishRebuild());
+		REQUIRE(tree4.NumPooledNodes() == pooled);
+		for (auto [x, y, o] : added)
+			tree4.Remove(x, y, o);
+		REQUIRE(tree4.NumObjects() == 0);
+		REQUIRE(tree4.NumPooledNodes() > pooled);
+	}
+}